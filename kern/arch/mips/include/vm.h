@@ -118,9 +118,10 @@ paddr_t ram_getfirstfree(void);
 
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * ASIDs are per-cpu, so the one thing every cpu agrees on is
+	 * the physical frame: drop whatever maps it.
 	 */
-	int ts_placeholder;
+	paddr_t ts_paddr;
 };
 
 #define TLBSHOOTDOWN_MAX 16
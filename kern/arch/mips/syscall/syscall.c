@@ -174,6 +174,14 @@ syscall(struct trapframe *tf)
             err = sys_getpid(&retval);
             break;
 
+        case SYS_getpriority:
+            err = sys_getpriority((int)tf->tf_a0, (int)tf->tf_a1, &retval);
+            break;
+
+        case SYS_setpriority:
+            err = sys_setpriority((int)tf->tf_a0, (int)tf->tf_a1, (int)tf->tf_a2);
+            break;
+
         case SYS_execv:
             err = sys_execv((const char *)tf->tf_a0, (char **)tf->tf_a1);
             break;
@@ -192,6 +200,27 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
 		break;
 
+        case SYS_mmap: {
+            // fd is at sp+16; the 64-bit offset is aligned to sp+24
+            int32_t fd;
+            off_t offset;
+            err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+            if (err) {
+                break;
+            }
+            err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+            if (err) {
+                break;
+            }
+            err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+                           (int)tf->tf_a3, fd, offset, (vaddr_t *)&retval);
+            break;
+        }
+
+        case SYS_munmap:
+            err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+            break;
+
 
         default:
             kprintf("Unknown syscall %d\n", callno);
@@ -103,6 +103,19 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+bool
+vm_idle_zero(void)
+{
+	/* nothing to do */
+	return false;
+}
+
+void
+vm_age_tick(void)
+{
+	/* nothing to do */
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -48,17 +49,93 @@ typedef enum {
 
 /*
  * Page Table Entry of a process
+ *
+ * After fork, parent and child point at the same PTE until one of them
+ * writes the page (copy-on-write); refcount is the number of page
+ * tables holding it. Sharing the PTE rather than just the frame means
+ * a shared page can be evicted and swapped back in once for everybody.
+ * While refcount > 1 the page is only ever mapped read-only.
+ *
+ * A resident page that is not dirty still has a valid copy in swap at
+ * diskpage_location, and is mapped read-only until it is first written
+ * so that evicting it again needs no swap write.
+ *
+ * tlb_cpus has a bit for every CPU that has loaded the page into its
+ * TLB since the frame was last shot down, so eviction only has to
+ * interrupt those.
+ *
+ * A cached PTE is program text shared through the page cache. It is
+ * never written in place, even with a single mapper, since the next
+ * process to run the binary may pick it up; a write copies it.
+ *
+ * file_dirty is set on a page of a MAP_SHARED file mapping when it is
+ * first written; only such pages are written back to the file. Until
+ * then the page is mapped read-only so that the write faults. Writing
+ * it back clears the flag and makes the page read-only again.
+ *
+ * A page table only holds an UNMAPPED PTE for a page of a shared
+ * mapping that as_copy had to share before anybody touched it; the
+ * first fault through any of the sharers gives it a frame.
+ *
+ * A PTE is four 32-bit words, since there is one per resident page.
+ * Addresses are kept as page numbers. Everything but tlb_cpus and the
+ * swap slot is packed into bitfields; refcount therefore tops out at
+ * PTE_REFCOUNT_MAX sharers. Instead of a struct lock of its own, a PTE
+ * is locked with its busy bit (see pte_lock in pagetable.c), which
+ * sits in the same word as other fields: those are only ever written
+ * by the thread holding the PTE locked, or before it is published.
  */
 struct page_table_entry {
-	vaddr_t as_vpage;
-	paddr_t as_ppage;
-	int vpage_permission;
-	vpage_state state;
-	unsigned int diskpage_location;
-	struct lock *lock;
-	struct page_table_entry *next; 	
+	uint32_t vpn:20;		/* Virtual page number */
+	uint32_t state:2;		/* vpage_state */
+	uint32_t dirty:1;
+	uint32_t cached:1;
+	uint32_t file_dirty:1;
+	uint32_t busy:1;		/* Locked */
+	uint32_t :6;
+	uint32_t ppn:20;		/* Physical page number, while MAPPED */
+	uint32_t refcount:12;
+	uint32_t diskpage_location;	/* Swap slot */
+	uint32_t tlb_cpus;
 };
 
+#define PTE_REFCOUNT_MAX	((1 << 12) - 1)
+#define PTE_VADDR(pte)		((vaddr_t)(pte)->vpn * PAGE_SIZE)
+#define PTE_PADDR(pte)		((paddr_t)(pte)->ppn * PAGE_SIZE)
+
+/*
+ * Two-level page table, MIPS style: the top 10 bits of a virtual
+ * address index the page directory, the next 10 bits index a
+ * second-level table, and the low 12 bits are the page offset.
+ * Both levels are one page of pointers.
+ */
+#define PT_DIR_ENTRIES		1024
+#define PT_TABLE_ENTRIES	1024
+#define PT_DIR_INDEX(vaddr)	((vaddr) >> 22)
+#define PT_TABLE_INDEX(vaddr)	(((vaddr) >> 12) & (PT_TABLE_ENTRIES - 1))
+#define PT_VADDR(dir, table)	(((vaddr_t)(dir) << 22) | ((vaddr_t)(table) << 12))
+
+struct page_table {
+	struct page_table_entry *pt_entries[PT_TABLE_ENTRIES];
+};
+
+/*
+ * A region may be backed by part of an executable: FILE_SIZE bytes at
+ * FILE_OFFSET in VNODE appear at FILE_VADDR, which need not be page
+ * aligned. Those pages are read in on first touch; the rest of the
+ * region (BSS) is zero-filled.
+ *
+ * Regions made by mmap are flagged mmapped: their permissions are
+ * enforced and munmap may remove them. A shared one is never copied on
+ * write, so after fork both processes see the same pages, and if it
+ * is backed by a file the pages written are written back to it when
+ * the mapping goes away. Processes that map the same file separately
+ * see each other's changes only through the file.
+ *
+ * An address space keeps its regions in a list sorted by address, and
+ * for lookups by address also in an array in the same order. Regions
+ * never nest, though segments of an executable may share a page.
+ */
 struct region {
 	vaddr_t start;
 	size_t size;
@@ -66,6 +143,12 @@ struct region {
 	bool read;
 	bool write;
 	bool execute;
+	struct vnode *vnode;
+	vaddr_t file_vaddr;
+	off_t file_offset;
+	size_t file_size;
+	bool mmapped;
+	bool shared;
 	struct region *next;
 };
 
@@ -88,9 +171,16 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
 	struct region *start_region;
-	struct page_table_entry *start_page_table;
+	struct region **region_index;	/* Sorted, for binary search */
+	unsigned int region_count;
+	unsigned int region_index_size;
+	struct region *region_hint;	/* Last region found by address */
+	struct page_table **page_directory;
 	vaddr_t heap_start;
 	vaddr_t heap_end;
+	/* TLB address space ID on each CPU, valid for one generation */
+	unsigned int asid[MAXCPUS];
+	unsigned int asid_generation[MAXCPUS];
 #endif
 };
 
@@ -121,6 +211,36 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - back the region containing VADDR with FILESIZE
+ *                bytes of V at OFFSET, to be read in on demand.
+ *
+ *    as_read_file_page - fill KBUF with whatever part of the page at
+ *                VADDR comes from a backing file. Sets *BACKED to
+ *                whether any of it does; with KBUF NULL, only that.
+ *
+ *    as_text_page - true if the page at VADDR is read-only and comes
+ *                from exactly one file, so that it can be shared with
+ *                other processes running the same binary; hands back
+ *                the file and the offset the page starts at.
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *                Tries the region found last time first.
+ *
+ *    as_range_free - true if no region overlaps START..END.
+ *
+ *    as_mmap   - add a region of LEN bytes with protection PROT (PROT_*)
+ *                somewhere below the stack, and hand back its address.
+ *                If V is set, FILESIZE bytes of it from OFFSET back the
+ *                start of the region.
+ *
+ *    as_munmap - remove whatever mmapped pages lie in ADDR..ADDR+LEN,
+ *                writing shared file pages back first.
+ *
+ *    as_unmap_range - drop every page in START..END, both page-aligned,
+ *                with its frame or swap slot, leaving the regions as
+ *                they are. Translations of the current address space
+ *                are shot out of the TLBs first.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -146,11 +266,112 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t filesize, struct vnode *v,
+                                 off_t offset);
+int               as_read_file_page(struct addrspace *as, vaddr_t vaddr,
+                                    void *kbuf, bool *backed);
+bool              as_text_page(struct addrspace *as, vaddr_t vaddr,
+                               struct vnode **v, off_t *offset);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+bool              as_range_free(struct addrspace *as, vaddr_t start, vaddr_t end);
+int               as_mmap(struct addrspace *as, size_t len, int prot,
+                          bool shared, struct vnode *v, off_t offset,
+                          size_t filesize, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+void              as_unmap_range(struct addrspace *as, vaddr_t start,
+                                 vaddr_t end);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_create  - allocate the (empty) page directory of AS.
+ *
+ *    pt_destroy - free the page directory and second-level tables.
+ *                All PTEs must already have been removed.
+ *
+ *    pt_lookup  - return the PTE for page VADDR, or NULL.
+ *
+ *    pt_insert  - install PTE for page VADDR, which must not have one.
+ *                May fail with ENOMEM allocating a second-level table.
+ *
+ *    pt_remove  - unhook and return the PTE for page VADDR, or NULL.
+ *                The caller disposes of the PTE.
+ *
+ *    pte_create - allocate an UNMAPPED PTE for page VADDR with one
+ *                reference.
+ *
+ *    pte_destroy - free a PTE that nothing refers to any more.
+ *
+ *    pte_release - drop one page table's reference to PTE; the last
+ *                reference gives back the frame or swap slot and frees
+ *                the PTE.
+ *
+ *    pte_release_batch - pte_release for up to PTE_BATCH PTEs that are
+ *                no longer in the page table, freeing frames and swap
+ *                slots together. Overwrites the array.
+ *
+ *    pte_lock_bootstrap - set up the wait channels pte_lock sleeps on.
+ *
+ *    pte_lock   - lock PTE, sleeping until nobody else has it locked.
+ *
+ *    pte_unlock - unlock PTE, which the caller has locked.
+ *
+ *    pte_locked - true if somebody (presumably the caller) has PTE
+ *                locked. For assertions.
+ *
+ *    pt_memory_usage - report the number of PTEs in existence and of
+ *                page-sized page table pages (directories and
+ *                second-level tables).
+ */
+
+int                      pt_create(struct addrspace *as);
+void                     pt_destroy(struct addrspace *as);
+struct page_table_entry *pt_lookup(struct addrspace *as, vaddr_t vaddr);
+int                      pt_insert(struct addrspace *as, vaddr_t vaddr,
+                                   struct page_table_entry *pte);
+struct page_table_entry *pt_remove(struct addrspace *as, vaddr_t vaddr);
+
+struct page_table_entry *pte_create(vaddr_t vaddr);
+void                     pte_destroy(struct page_table_entry *pte);
+void                     pte_release(struct page_table_entry *pte);
+void                     pte_release_batch(struct page_table_entry **ptes,
+                                           unsigned int n);
+void                     pte_lock_bootstrap(void);
+void                     pte_lock(struct page_table_entry *pte);
+void                     pte_unlock(struct page_table_entry *pte);
+bool                     pte_locked(struct page_table_entry *pte);
+void                     pt_memory_usage(unsigned int *ptes, unsigned int *tables);
+
+
+/*
+ * Functions in pagecache.c:
+ *
+ *    pagecache_bootstrap - set up the cache of shared text pages.
+ *
+ *    pagecache_lookup - return the cached PTE for page VADDR of file V
+ *                at OFFSET with a new reference for the caller, or NULL.
+ *
+ *    pagecache_insert - enter PTE, which must be MAPPED and marked
+ *                cached, as the page of V at OFFSET. Fails
+ *                with EEXIST if another PTE got there first.
+ *
+ *    pagecache_remove - forget PTE, if it is cached. Called as the last
+ *                reference to it is dropped.
+ */
+
+void                     pagecache_bootstrap(void);
+struct page_table_entry *pagecache_lookup(struct vnode *v, off_t offset,
+                                          vaddr_t vaddr);
+int                      pagecache_insert(struct vnode *v, off_t offset,
+                                          struct page_table_entry *pte);
+void                     pagecache_remove(struct page_table_entry *pte);
+
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
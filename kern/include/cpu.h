@@ -36,6 +36,13 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of priority levels of the scheduler (see schedule() in
+ * thread.c). Level 0 is the highest.
+ */
+#define SCHED_LEVELS 4
+
+
 /*
  * Per-cpu structure
  *
@@ -59,15 +66,31 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Scheduler statistics, for the cpustat menu command. Written
+	 * only by this cpu; reset from anywhere.
+	 */
+	unsigned c_statclocks;		/* hardclock() calls since reset */
+	unsigned c_idleclocks;		/* ...that found this cpu idle */
+	unsigned c_steals;		/* Times we took threads from others */
+	unsigned c_stolen;		/* Threads we took */
+	unsigned c_wakeups;		/* Threads made runnable from here */
+	unsigned c_remote_wakeups;	/* ...onto another cpu's run queue */
+	unsigned c_migrations;		/* ...onto a cpu they did not last run on */
+	unsigned c_unidle_ipis;		/* IPI_UNIDLEs sent */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_LEVELS]; /* Run queues, by level */
+	unsigned c_runcount;		/* Threads on all the run queues */
+	uint64_t c_minvruntime;		/* Least t_vruntime picked so far */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -83,10 +106,14 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdowns_done counts the batches of shootdowns this cpu
+	 * has carried out, so a sender can tell when its own are done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdowns_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -153,6 +180,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync carries out shootdowns on a set of CPUs (one
+ * bit per cpu number) and waits until they are done.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +196,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_sync(uint32_t cpumask,
+			       const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -61,6 +61,7 @@ struct proc {
     struct file_handler *file_table[OPEN_MAX]; /* File table */
 
     pid_t pid;
+    int p_nice;                    /* Niceness, PRIO_MIN to PRIO_MAX */
 
     struct array *children; 
 
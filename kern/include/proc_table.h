@@ -25,11 +25,16 @@ struct proc_table {
 extern struct proc_table *processes;
 
 int sys_getpid(int32_t *);
+int sys_getpriority(int, int, int32_t *);
+int sys_setpriority(int, int, int);
 int sys_fork(struct trapframe *, int32_t *);
 int sys_waitpid(pid_t, int32_t *, int32_t);
 void sys__exit(int32_t);
 int sys_execv(const char *, char **);
 int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset,
+             vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
 
 /* Creating and entering a new process */
 void enter_usermode(void *, unsigned long);
@@ -83,6 +83,11 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduler level, 0 = highest */
+	unsigned t_ticks;		/* Clock ticks used at that level */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when it last ran */
+	int t_nice;			/* Copy of t_proc->p_nice */
+	uint64_t t_vruntime;		/* Cpu time used, weighted by t_nice */
 
 	/*
 	 * Interrupt state fields.
@@ -157,16 +162,26 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for a clock tick, and switch to another
+ * if its time slice is up. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
+ * Potentially take ready threads from busier CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/* Print or reset the per-CPU scheduler statistics. */
+void thread_printstats(void);
+void thread_resetstats(void);
+
 
 #endif /* _THREAD_H_ */
@@ -32,6 +32,11 @@
 
 #include <machine/vm.h>
 #include <synch.h>
+#include <uio.h>
+
+struct addrspace;
+struct page_table_entry;
+struct vnode;
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -40,6 +45,9 @@
 
 #define VM_STACKPAGES 128
 
+/* Most PTEs released in one go by pte_release_batch */
+#define PTE_BATCH 64
+
 /* Coremap initialization start */
 
 typedef enum {
@@ -49,17 +57,28 @@ typedef enum {
     in_eviction
 } page_state;
 
+/*
+ * chunk_size is the length in pages of the kernel allocation starting
+ * at this frame, or of the free block starting here if the frame heads
+ * a block on one of the allocator's free lists; 0 otherwise.
+ * free_next/free_prev link free block heads (frame indices, 0 = none).
+ */
 struct coremap_page {
     int chunk_size;
     page_state state;
     struct addrspace *owner_addrspace;
     vaddr_t owner_vaddr;
+    struct page_table_entry *owner_pte;
     bool ref_bit;
+    uint8_t age;                /* For aging replacement */
+    unsigned int free_next;
+    unsigned int free_prev;
 };
 
 struct swap_disk {
     struct bitmap *bitmap;
     struct vnode *vnode;
+    unsigned int slots;         /* Size of the disk in pages */
     bool swap_disk_present;
 };
 
@@ -72,19 +91,90 @@ void coremap_bootstrap(void);  /* Renamed from coremap_load */
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Zero a free frame ahead of time; called from the idle loop */
+bool vm_idle_zero(void);
+
+/* Background page aging for the replacement policy; called from hardclock */
+void vm_age_tick(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-paddr_t allocate_user_page(unsigned long pages, struct addrspace *as, vaddr_t vpage_addr, bool copy_call); 
+paddr_t allocate_user_page(unsigned long pages, struct addrspace *as, vaddr_t vpage_addr,
+                           struct page_table_entry *pte, bool copy_call);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 int release_physical_page(paddr_t page_paddr);
+void release_pte_backing(struct page_table_entry *pte);
+void release_pte_backing_batch(struct page_table_entry **ptes, unsigned int n);
+int vm_writeback_page(struct page_table_entry *pte, struct vnode *v, off_t offset, size_t len);
 void tlb_invalidate_entry(vaddr_t remove_vaddr);
+void tlb_invalidate_range(vaddr_t start, vaddr_t end);
+void tlb_invalidate_all(void);
+void tlb_invalidate_frame(paddr_t paddr);
+void tlb_activate(struct addrspace *as);
+void tlb_invalidate_as(struct addrspace *as);
+void tlb_invalidate_as_elsewhere(struct addrspace *as);
 int read_swap_disk(paddr_t ppage_addr, unsigned int index, bool unmark); 
 int write_swap_disk(paddr_t ppage_addr, unsigned int *index);   
 void unmark_swap_bitmap(unsigned int index);                           
+int swap_disk_io(const paddr_t *frames, unsigned int n, unsigned int slot, enum uio_rw rw);
 paddr_t evict_page(void);                                              
 
+/* Compressed swap cache (zswap.c), keyed by swap slot */
+void zswap_bootstrap(unsigned int ram_pages);
+bool zswap_load(unsigned int slot, paddr_t paddr);
+int zswap_store(unsigned int slot, paddr_t paddr);
+void zswap_invalidate(unsigned int slot);
+void zswap_printstats(void);
+void zswap_resetstats(void);
+
+/*
+ * Paging statistics, reported by the "vmstat" menu command. Rates are
+ * computed over the time since the counters were last reset.
+ */
+struct vm_stats {
+    unsigned faults;            /* Calls to vm_fault */
+    unsigned zero_fills;        /* Faults satisfied with a fresh zeroed page */
+    unsigned zero_maps;         /* Reads satisfied by mapping the zero page */
+    unsigned zero_map_writes;   /* ...later written, so given a frame after all */
+    unsigned zero_pool_hits;    /* Allocations that got a pre-zeroed frame */
+    unsigned zero_pool_misses;  /* ...and that had to zero one themselves */
+    unsigned zero_pool_fills;   /* Frames zeroed by idle CPUs */
+    unsigned file_fills;        /* Pages read in from an executable on first touch */
+    unsigned text_shares;       /* Text pages mapped from the page cache */
+    unsigned file_writebacks;   /* Shared mmapped pages written back to their file */
+    unsigned swap_ins;          /* Pages read back from swap */
+    unsigned swap_outs;         /* Pages written to swap */
+    unsigned swap_readahead;    /* Pages read from swap ahead of a fault */
+    unsigned swap_read_ops;     /* Swap disk reads (one or more pages each) */
+    unsigned swap_write_ops;    /* Swap disk writes (one or more pages each) */
+    unsigned clean_evictions;   /* Evictions that skipped the swap write */
+    unsigned cow_faults;        /* Writes to pages shared copy-on-write */
+    unsigned cow_copies;        /* ...that had to copy the page */
+    unsigned tlb_flushes;       /* Whole-TLB invalidations */
+    unsigned tlb_shootdowns;    /* Shootdown IPIs sent to other CPUs */
+    unsigned asid_rollovers;    /* ASID generations used up */
+    unsigned evictions;         /* Frames reclaimed by the clock sweep */
+    unsigned eviction_waits;    /* Sleeps waiting for another eviction */
+    unsigned eviction_failures; /* Allocations that found nothing to evict */
+    unsigned direct_reclaims;   /* Evictions done by the faulting thread */
+    unsigned background_reclaims; /* Evictions done by the pageout daemon */
+};
+
+void vm_getstats(struct vm_stats *snapshot);
+void vm_printstats(void);
+void vm_resetstats(void);
+
+/* Page replacement policy, by name: "clock", "esc" or "aging" */
+int vm_set_policy(const char *name);
+const char *vm_get_policy(void);
+const char *vm_policy_name(unsigned int i);
+
+/* Pageout daemon watermarks, in free pages */
+int vm_set_watermarks(unsigned int low, unsigned int high);
+void vm_get_watermarks(unsigned int *low, unsigned int *high, unsigned int *free_pages);
+
 /*
  * Return amount of memory (in bytes) used by allocated coremap pages.
  * If there are ongoing allocations, this value could change after it
@@ -94,6 +184,7 @@ paddr_t evict_page(void);
 unsigned int coremap_memory_usage(void); /* Renamed from coremap_used_bytes */
 
 /* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
 #endif /* _VM_H_ */
@@ -42,6 +42,7 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -410,6 +411,159 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_resetstats();
+	}
+	else {
+		kprintf("Usage: vmstat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_cpustat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		thread_resetstats();
+	}
+	else {
+		kprintf("Usage: cpustat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	unsigned low, high, freepages;
+	int result;
+
+	if (nargs == 3) {
+		result = vm_set_watermarks(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("pageout: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: pageout [low high]\n");
+		return 0;
+	}
+
+	vm_get_watermarks(&low, &high, &freepages);
+	kprintf("Pageout watermarks: low %u, high %u pages (%u free)\n",
+		low, high, freepages);
+	return 0;
+}
+
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	const char *name;
+	unsigned i;
+	int result;
+
+	if (nargs == 2) {
+		result = vm_set_policy(args[1]);
+		if (result) {
+			kprintf("vmpolicy: %s: %s\n", args[1],
+				strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmpolicy [policy]\n");
+		return 0;
+	}
+
+	kprintf("Page replacement: %s (available:", vm_get_policy());
+	for (i=0; (name = vm_policy_name(i)) != NULL; i++) {
+		kprintf(" %s", name);
+	}
+	kprintf(")\n");
+	return 0;
+}
+
+/*
+ * Run each program given once under each replacement policy, and
+ * report what it cost. The programs run without arguments, so they
+ * should be ones whose defaults give the VM system some exercise;
+ * with none given, a standard set of VM tests is run. The policy in
+ * effect beforehand is put back afterwards.
+ */
+static const char *vmcompare_progs[] = {
+	"vmcompare",
+	"/testbin/huge",
+	"/testbin/matmult",
+	"/testbin/sort",
+	"/testbin/readthrash",
+	"/testbin/swapstress",
+};
+
+static
+int
+cmd_vmcompare(int nargs, char **args)
+{
+	struct vm_stats before, after;
+	struct timespec start, end;
+	const char *saved, *name;
+	unsigned i;
+	int j, result;
+
+	if (nargs == 1) {
+		args = (char **)vmcompare_progs;
+		nargs = sizeof(vmcompare_progs) / sizeof(vmcompare_progs[0]);
+	}
+
+	saved = vm_get_policy();
+	kprintf("%-20s %-6s %9s %9s %9s %9s %9s\n", "program", "policy",
+		"faults", "evictions", "swap ins", "swap outs", "ms");
+
+	for (j=1; j<nargs; j++) {
+		for (i=0; (name = vm_policy_name(i)) != NULL; i++) {
+			vm_set_policy(name);
+			vm_getstats(&before);
+			gettime(&start);
+
+			result = common_prog(1, &args[j]);
+			if (result) {
+				vm_set_policy(saved);
+				return result;
+			}
+
+			gettime(&end);
+			vm_getstats(&after);
+			timespec_sub(&end, &start, &end);
+			kprintf("%-20s %-6s %9u %9u %9u %9u %9lu\n",
+				args[j], name,
+				after.faults - before.faults,
+				after.evictions - before.evictions,
+				after.swap_ins - before.swap_ins,
+				after.swap_outs - before.swap_outs,
+				(unsigned long)(end.tv_sec * 1000 +
+						end.tv_nsec / 1000000));
+		}
+	}
+
+	vm_set_policy(saved);
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -516,6 +670,11 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM paging statistics       ",
+	"[pageout] Pageout watermarks        ",
+	"[vmpolicy] Page replacement policy  ",
+	"[vmcompare] Compare policies        ",
+	"[cpustat] Scheduler statistics      ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -570,6 +729,11 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstat },
+	{ "pageout",    cmd_pageout },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "vmcompare",  cmd_vmcompare },
+	{ "cpustat",    cmd_cpustat },
 
 	/* base system tests */
 	{ "at",		arraytest },
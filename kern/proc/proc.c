@@ -103,6 +103,7 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 	proc->pid = 1;
+	proc->p_nice = 0;
 	
 	return proc;
 }
@@ -162,6 +163,7 @@ proc_create_fork(const char *name, struct proc **new_proc)
 		VOP_INCREF(curproc->p_cwd);
 		proc->p_cwd = curproc->p_cwd;
 	}
+	proc->p_nice = curproc->p_nice;
 	spinlock_release(&curproc->p_lock);
 	
 	spinlock_acquire(&curproc->p_lock);
@@ -467,6 +469,9 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 	spinlock_acquire(&proc->p_lock);
 	result = threadarray_add(&proc->p_threads, t, NULL);
+	if (result == 0) {
+		t->t_nice = proc->p_nice;
+	}
 	spinlock_release(&proc->p_lock);
 	if (result) {
 		return result;
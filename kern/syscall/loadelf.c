@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without dumbvm, "loading" a segment only records where it lives in
+ * the file (as_define_file); vm_fault reads each page in when it is
+ * first touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -58,6 +59,7 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <stat.h>
 #include <elf.h>
 
 /*
@@ -72,7 +74,7 @@
  * Note that uiomove will catch it if someone tries to load an
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * explicitly. (as_define_file does.)
  */
 static
 int
@@ -81,8 +83,12 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_DUMBVM
 	struct iovec iov;
 	struct uio u;
+#else
+	struct stat st;
+#endif
 	int result;
 
 	if (filesize > memsize) {
@@ -90,6 +96,25 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if !OPT_DUMBVM
+	(void)is_executable;
+
+	/* Catch a truncated file now rather than at some later fault. */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, vaddr, filesize, v, offset);
+#else
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -143,6 +168,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_DUMBVM */
 }
 
 /*
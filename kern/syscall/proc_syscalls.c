@@ -10,6 +10,12 @@
 #include <copyinout.h>
 #include <proc_table.h>
 #include <wchan.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <file_handler.h>
+#include <vnode.h>
+#include <stat.h>
 
 
 void
@@ -78,6 +84,95 @@ sys_getpid(int32_t *retval)
 	return 0;
 }
 
+/*
+ Finds the process a getpriority or setpriority call is about, and
+ returns it with processes->lock held so that it cannot exit meanwhile.
+ WHO 0 means the current process. Only PRIO_PROCESS is supported: there
+ are no process groups, and no users.
+ */
+static
+int
+priority_getproc(int which, int who, struct proc **ret)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who == 0) {
+		who = curproc->pid;
+	}
+	if (who < PID_MIN ||
+	    who >= (int)(sizeof(processes->status) / sizeof(processes->status[0]))) {
+		return ESRCH;
+	}
+
+	lock_acquire(processes->lock);
+	if (processes->status[who] != RUNNING &&
+	    processes->status[who] != ORPHAN) {
+		lock_release(processes->lock);
+		return ESRCH;
+	}
+	*ret = processes->proc[who];
+	return 0;
+}
+
+/*
+ Gets the niceness of a process.
+ */
+int
+sys_getpriority(int which, int who, int32_t *retval)
+{
+	struct proc *proc;
+	int ret;
+
+	ret = priority_getproc(which, who, &proc);
+	if (ret) {
+		return ret;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	*retval = proc->p_nice;
+	spinlock_release(&proc->p_lock);
+
+	lock_release(processes->lock);
+	return 0;
+}
+
+/*
+ Sets the niceness of a process, and of all its threads, which is what
+ the scheduler looks at. Values out of range are clamped to it. There
+ are no users, so anybody may make any process less nice as well.
+ */
+int
+sys_setpriority(int which, int who, int prio)
+{
+	struct proc *proc;
+	unsigned i, num;
+	int ret;
+
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+
+	ret = priority_getproc(which, who, &proc);
+	if (ret) {
+		return ret;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_nice = prio;
+	num = threadarray_num(&proc->p_threads);
+	for (i = 0; i < num; i++) {
+		threadarray_get(&proc->p_threads, i)->t_nice = prio;
+	}
+	spinlock_release(&proc->p_lock);
+
+	lock_release(processes->lock);
+	return 0;
+}
+
 /*
  Function called by a parent process to wait until a child process exits.
  */
@@ -413,9 +508,7 @@ sys_execv(const char *prog, char **args)
 int sys_sbrk(intptr_t increment, vaddr_t *retval) {
     struct addrspace *addr_space;
     long old_heap_end, new_heap_end;
-    int num_pages, err;
-    vaddr_t remove_vaddr;
-    struct page_table_entry *current_pte, *previous_pte;
+    int num_pages;
 
     addr_space = proc_getas();
     KASSERT(addr_space != NULL);
@@ -437,6 +530,9 @@ int sys_sbrk(intptr_t increment, vaddr_t *retval) {
     if (increment > 0 && new_heap_end >= (long)(USERSTACK - VM_STACKPAGES * PAGE_SIZE)) {
         return ENOMEM;
     }
+    if (increment > 0 && !as_range_free(addr_space, (vaddr_t)old_heap_end, (vaddr_t)new_heap_end)) {
+        return ENOMEM; // Would run into an mmapped region
+    }
     if (increment % PAGE_SIZE != 0) {
         return EINVAL;
     }
@@ -451,46 +547,73 @@ int sys_sbrk(intptr_t increment, vaddr_t *retval) {
     if (increment > 0) {
         addr_space->heap_end = (vaddr_t)new_heap_end;
     } else {
-        for (int i = 0; i < -num_pages; i++) {
-            remove_vaddr = old_heap_end - (i + 1) * PAGE_SIZE;
-            current_pte = addr_space->start_page_table;
-            previous_pte = NULL;
-
-            while (current_pte != NULL) {
-                if (current_pte->as_vpage == remove_vaddr) {
-                    lock_acquire(current_pte->lock);
-
-                    if (current_pte->state == SWAPPED) {
-                        unmark_swap_bitmap(current_pte->diskpage_location);
-                    } else {
-                        err = release_physical_page(current_pte->as_ppage);
-                        if (err) {
-                            lock_release(current_pte->lock);
-                            continue;
-                        }
-                        tlb_invalidate_entry(remove_vaddr);
-                    }
-
-                    lock_release(current_pte->lock);
-
-                    if (current_pte == addr_space->start_page_table) {
-                        addr_space->start_page_table = current_pte->next;
-                    } else {
-                        previous_pte->next = current_pte->next;
-                    }
-
-                    lock_destroy(current_pte->lock);
-                    kfree(current_pte);
-                    break;
-                }
-
-                previous_pte = current_pte;
-                current_pte = current_pte->next;
-            }
-        }
+        as_unmap_range(addr_space, (vaddr_t)new_heap_end, (vaddr_t)old_heap_end);
         addr_space->heap_end = (vaddr_t)new_heap_end;
     }
 
     *retval = (vaddr_t)old_heap_end;
     return 0;
 }
+
+/*
+ * The address hint is ignored; there is no MAP_FIXED. File mappings
+ * need a page-aligned offset and a file opened for reading, and for
+ * writable shared ones, for writing as well.
+ */
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset,
+             vaddr_t *retval) {
+    struct addrspace *as = proc_getas();
+    struct vnode *v = NULL;
+    size_t filesize = 0;
+    int type = flags & MAP_TYPE;
+    int result;
+
+    (void)addr;
+    KASSERT(as != NULL);
+
+    if (len == 0 || (type != MAP_SHARED && type != MAP_PRIVATE) ||
+        (flags & ~(MAP_TYPE | MAP_ANONYMOUS)) != 0 ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+        return EINVAL;
+    }
+
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (offset < 0 || offset % PAGE_SIZE != 0) {
+            return EINVAL;
+        }
+        if (fd < 0 || fd >= OPEN_MAX || curproc->file_table[fd] == NULL) {
+            return EBADF;
+        }
+
+        struct file_handler *fh = curproc->file_table[fd];
+        if (fh->mode == O_WRONLY ||
+            (type == MAP_SHARED && (prot & PROT_WRITE) && fh->mode != O_RDWR)) {
+            return EACCES;
+        }
+
+        result = VOP_MMAP(fh->vnode);
+        if (result) {
+            return result;
+        }
+
+        // Past the end of the file the mapping reads as zeroes
+        struct stat st;
+        result = VOP_STAT(fh->vnode, &st);
+        if (result) {
+            return result;
+        }
+        if (st.st_size > offset) {
+            filesize = st.st_size - offset < (off_t)len ? (size_t)(st.st_size - offset) : len;
+        }
+        v = fh->vnode;
+    }
+
+    return as_mmap(as, len, prot, type == MAP_SHARED, v, offset, filesize, retval);
+}
+
+int sys_munmap(vaddr_t addr, size_t len) {
+    struct addrspace *as = proc_getas();
+    KASSERT(as != NULL);
+
+    return as_munmap(as, addr, len);
+}
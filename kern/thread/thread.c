@@ -35,6 +35,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -78,6 +80,10 @@ static struct wchanarray allwchans;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static unsigned thread_steal(unsigned margin);
+static void sched_enqueue(struct cpu *c, struct thread *t);
+static struct thread *sched_pick(struct threadlist *tl);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -118,26 +124,18 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Initialize a new, or reused, thread structure. The stack is left
+ * alone.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -145,10 +143,14 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
+	thread->t_nice = 0;
+	thread->t_vruntime = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -157,6 +159,94 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+
+	if (thread_init(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+ * Cache of dead threads.
+ *
+ * Every thread costs a kmalloc for struct thread and another, a whole
+ * page from alloc_kpages, for its stack, and both are freed when it
+ * exits. Under fork-heavy loads that is a good part of the cost of
+ * fork and exit. Instead, thread_destroy keeps up to THREAD_CACHE_MAX
+ * dead threads per cpu with their stacks, and thread_fork reuses one
+ * of those when it can. Each cpu only touches its own cache, so
+ * raising the spl is enough to protect it; threads are put in it by
+ * exorcise() at the end of a context switch.
+ *
+ * A cached stack keeps the magic numbers from thread_checkstack_init.
+ * They are checked when the stack goes into the cache, in case its
+ * thread overflowed it, and again when it comes out, in case something
+ * scribbled on it meanwhile.
+ */
+#define THREAD_CACHE_MAX	8
+
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	bool cached = false;
+	int spl;
+
+	if (thread->t_stack == NULL) {
+		return false;
+	}
+	thread_checkstack(thread);
+
+	spl = splhigh();
+	if (curcpu->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+		threadlist_addtail(&curcpu->c_threadcache, thread);
+		cached = true;
+	}
+	splx(spl);
+
+	return cached;
+}
+
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread_checkstack(thread);
+
+	if (thread_init(thread, name)) {
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
 	return thread;
 }
 
@@ -174,6 +264,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -185,15 +276,29 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_statclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
+	c->c_stolen = 0;
+	c->c_wakeups = 0;
+	c->c_remote_wakeups = 0;
+	c->c_migrations = 0;
+	c->c_unidle_ipis = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_minvruntime = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -256,9 +361,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -266,6 +368,15 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	/* Keep it, stack and all, for thread_fork if there's room */
+	if (thread_cache_put(thread)) {
+		return;
+	}
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
 	kfree(thread);
 }
 
@@ -296,6 +407,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -310,9 +424,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -442,10 +560,161 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. Each cpu has a queue per scheduler level;
+ * a thread is queued at its own level, t_priority, and threads are
+ * taken from the highest level that has any, in t_vruntime order
+ * within it (see sched_pick). The caller holds the cpu's run queue
+ * lock.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < SCHED_LEVELS);
+
+	sched_enqueue(c, t);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+/*
+ * Return the highest level with a thread waiting, or SCHED_LEVELS if
+ * the run queues are empty.
+ */
+static
+unsigned
+runqueue_top(struct cpu *c)
+{
+	unsigned level;
+
+	for (level=0; level<SCHED_LEVELS; level++) {
+		if (!threadlist_isempty(&c->c_runqueue[level])) {
+			break;
+		}
+	}
+	return level;
+}
+
+/*
+ * Take the thread that should run next.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned level;
+
+	level = runqueue_top(c);
+	if (level == SCHED_LEVELS) {
+		return NULL;
+	}
+	c->c_runcount--;
+	t = sched_pick(&c->c_runqueue[level]);
+	if (t->t_vruntime > c->c_minvruntime) {
+		c->c_minvruntime = t->t_vruntime;
+	}
+	return t;
+}
+
+/*
+ * Take the thread that would run last, from the lowest level.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	unsigned level;
+
+	for (level=SCHED_LEVELS; level-- > 0; ) {
+		if (!threadlist_isempty(&c->c_runqueue[level])) {
+			c->c_runcount--;
+			return threadlist_remtail(&c->c_runqueue[level]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Choose the cpu for a thread that is being woken up, or is new, and
+ * return it with its run queue locked and the thread's t_cpu set.
+ *
+ * The cpu the thread last ran on, t_cpu, is preferred if it is idle,
+ * or if the thread ran there within the last CACHE_HOT_TICKS ticks
+ * and will not have to wait long: its working set is likely still in
+ * that cpu's cache. Otherwise an idle cpu gets it, and failing that,
+ * whichever of the last cpu and the waker's own has fewer threads
+ * waiting, with ties going to the last cpu.
+ *
+ * A thread may be woken while its last cpu is still switching away
+ * from it, or has gone idle with it still curthread; either way that
+ * cpu is still on the thread's stack and nobody else may run it. Its
+ * run queue lock is held until the switch is complete, so looking at
+ * c_curthread under that lock tells. Other cpus' loads are read
+ * without their locks, as hints, and only the run queue lock of the
+ * cpu chosen is then taken.
+ */
+#define CACHE_HOT_TICKS	2	/* How long a thread's cache stays warm */
+#define CACHE_HOT_WAIT	2	/* Most threads a hot one should wait for */
+
+static
+struct cpu *
+thread_place(struct thread *target)
+{
+	struct cpu *prev, *best, *c;
+	unsigned i, numcpus;
+	bool hot;
+
+	prev = target->t_cpu;
+	curcpu->c_wakeups++;
+
+	spinlock_acquire(&prev->c_runqueue_lock);
+	hot = prev->c_hardclocks - target->t_lastran < CACHE_HOT_TICKS;
+	if (prev->c_curthread == target || prev->c_isidle ||
+	    (hot && prev->c_runcount < CACHE_HOT_WAIT)) {
+		best = prev;
+	}
+	else {
+		spinlock_release(&prev->c_runqueue_lock);
+
+		best = NULL;
+		numcpus = cpuarray_num(&allcpus);
+		for (i=0; i<numcpus && best == NULL; i++) {
+			c = cpuarray_get(&allcpus, i);
+			if (c->c_isidle) {
+				best = c;
+			}
+		}
+		if (best == NULL) {
+			best = prev;
+			if (curcpu->c_runcount < prev->c_runcount) {
+				best = curcpu->c_self;
+			}
+		}
+
+		spinlock_acquire(&best->c_runqueue_lock);
+		if (best != prev) {
+			curcpu->c_migrations++;
+			DEBUG(DB_THREADS, "Woke thread %s on cpu %u (last %u)",
+			      target->t_name, best->c_number, prev->c_number);
+		}
+		target->t_cpu = best;
+	}
+
+	if (best != curcpu->c_self) {
+		curcpu->c_remote_wakeups++;
+	}
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * If we already have the lock, the thread is curthread yielding and
+ * goes back on its own cpu's run queue. Otherwise thread_place picks a
+ * cpu; it might be curcpu, it might not be.
  */
 static
 void
@@ -453,27 +722,28 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
-
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
+		targetcpu = target->t_cpu;
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		targetcpu = thread_place(target);
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
-	if (targetcpu->c_isidle) {
+	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
 		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * sure it unidles. If it is us, we are in an
+		 * interrupt taken from the idle loop, which will
+		 * look at the run queue again when we return.
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
+		curcpu->c_unidle_ipis++;
 	}
 
 	if (!already_have_lock) {
@@ -500,18 +770,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if this cpu has one */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -519,6 +793,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_vruntime = curthread->t_vruntime;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -588,12 +863,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* For thread_place: how warm the cache is when it next wakes */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -602,6 +880,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/* Gave up the cpu before its time was up; see schedule() */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -633,6 +915,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * interrupt from another cpu posting a wakeup) and idling
 	 * *is* atomic with respect to re-enabling interrupts.
 	 *
+	 * Before actually idling, try to steal threads from a busier
+	 * cpu (see thread_steal), and failing that, give the VM system
+	 * a chance to zero free frames ahead of time. It does one
+	 * frame per call, so we look at the runqueue again after each.
+	 *
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
@@ -641,10 +928,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (thread_steal(1) == 0 && !vm_idle_zero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -825,139 +1114,339 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Threads are scheduled with a multi-level feedback queue. Each cpu
+ * has a run queue per level and always runs a thread from the highest
+ * level that has one. At level L a thread gets a time slice of
+ * SCHED_QUANTUM(L) clock ticks, and using all of it moves the thread
+ * down a level; so threads that compute sink, and get longer slices
+ * less often. Going to sleep moves a thread up a level; so threads
+ * that mostly wait for something, like a shell waiting for input or
+ * for its child, stay near the top and get the cpu soon after they
+ * wake up. New threads start at the top.
+ *
+ * A thread that slept just before the end of every slice could sit at
+ * the top while using nearly all the cpu. Promotion therefore keeps
+ * the ticks already used, and such a thread goes straight back down
+ * at its next tick.
+ *
+ * The process's niceness (see setpriority) decides which thread at a
+ * level goes next. Each thread has a virtual run time, t_vruntime,
+ * advanced on every tick it runs by an amount inversely proportional
+ * to its weight, and the thread with the least virtual run time at
+ * the top level is the one picked. Each step of niceness above 0
+ * makes the weight about 1.25 times smaller and each step below about
+ * 1.25 times larger, so of two threads computing at the same level,
+ * one 10 steps nicer than the other gets about a ninth (110/1024) of
+ * the cpu time the other gets. Since the weighting accumulates
+ * across slices rather than rounding each one, this holds at every
+ * level and over the whole range of niceness. Slice lengths and
+ * levels do not depend on niceness: a nice thread that sleeps still
+ * runs soon after it wakes up.
+ *
+ * A thread that has been asleep, or is new, or comes from another
+ * cpu, might be far behind the virtual run time of the threads here,
+ * and would keep the cpu until it caught up. So a thread being queued
+ * is moved up to at most SCHED_SLEEPER_CREDIT behind c_minvruntime,
+ * the furthest virtual run time of any thread picked on that cpu.
+ */
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_NICE_0_WEIGHT	1024
+#define SCHED_VRUNTIME_SCALE	(SCHED_NICE_0_WEIGHT << 16)
+#define SCHED_SLEEPER_CREDIT	((uint64_t)SCHED_QUANTUM(SCHED_LEVELS - 1) \
+				 * (SCHED_VRUNTIME_SCALE / SCHED_NICE_0_WEIGHT))
+
+static const unsigned sched_nice_weight[PRIO_MAX - PRIO_MIN + 1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548, 7620, 6100, 4904, 3906,
+	/*  -5 */ 3121, 2501, 1991, 1586, 1277,
+	/*   0 */ 1024, 820, 655, 526, 423,
+	/*   5 */ 335, 272, 215, 172, 137,
+	/*  10 */ 110, 87, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15,
+	/*  20 */ 12,
+};
+
+/*
+ * Virtual run time of one tick of T.
+ */
+static
+unsigned
+sched_vtick(struct thread *t)
+{
+	KASSERT(t->t_nice >= PRIO_MIN && t->t_nice <= PRIO_MAX);
+	return SCHED_VRUNTIME_SCALE / sched_nice_weight[t->t_nice - PRIO_MIN];
+}
+
+/*
+ * Called by runqueue_add as T goes on C's run queue.
+ */
+static
+void
+sched_enqueue(struct cpu *c, struct thread *t)
+{
+	if (c->c_minvruntime > SCHED_SLEEPER_CREDIT &&
+	    t->t_vruntime < c->c_minvruntime - SCHED_SLEEPER_CREDIT) {
+		t->t_vruntime = c->c_minvruntime - SCHED_SLEEPER_CREDIT;
+	}
+}
+
+/*
+ * Take the thread with the least virtual run time off TL, which is
+ * not empty; the first of them if there are several, so that threads
+ * of equal niceness take turns.
  */
+static
+struct thread *
+sched_pick(struct threadlist *tl)
+{
+	struct thread *t, *best;
+
+	best = NULL;
+	THREADLIST_FORALL(t, *tl) {
+		if (best == NULL || t->t_vruntime < best->t_vruntime) {
+			best = t;
+		}
+	}
+	KASSERT(best != NULL);
+	threadlist_remove(tl, best);
+	return best;
+}
+
+/*
+ * Called from hardclock() on every tick. Charge the tick to the
+ * current thread, and switch if its slice is used up or a thread at a
+ * higher level is waiting.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur;
+	bool yield;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_statclocks++;
+	if (curcpu->c_isidle) {
+		/* curthread is not actually running */
+		curcpu->c_idleclocks++;
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	cur->t_ticks++;
+	cur->t_vruntime += sched_vtick(cur);
+	yield = runqueue_top(curcpu) < cur->t_priority;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (yield) {
+		thread_yield();
+	}
+}
 
+/*
+ * This is called periodically from hardclock(). It moves every thread
+ * on the current cpu back up to the top level: threads at the bottom
+ * would otherwise starve behind a steady stream of interactive ones,
+ * and a thread that has stopped computing would stay down there.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned level;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (level=1; level<SCHED_LEVELS; level++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[level]))
+		       != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Threads move between CPUs by being stolen: a CPU that runs out of
+ * work takes half the waiting threads of the busiest other CPU before
+ * going idle, and tries again each time the timer wakes it. Busy CPUs
+ * also look around every MIGRATE_HARDCLOCKS ticks, in
+ * thread_consider_migration, and even out any larger imbalance the
+ * same way. Nobody ever pushes threads onto another CPU.
+ *
+ * Picking a victim looks at every CPU's c_runcount without its lock;
+ * the counts are only a hint, and are checked again under the lock of
+ * the one CPU chosen. At most one run queue lock is held at a time:
+ * the threads are taken off the victim's queues onto a private list,
+ * and only then added to ours.
+ *
+ * Threads are taken from the tail of the lowest level, the ones that
+ * would have waited longest where they were. An idle victim is left
+ * alone: it is about to run its own threads, and one of them may
+ * still be its curthread (see below). A busy cpu evening out the load
+ * also leaves alone threads that ran within CACHE_HOT_TICKS; an idle
+ * one is better off with a cold cache than with nothing to do.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. Stealing only when a CPU would otherwise have
+ * nothing to do, or when the imbalance is large, keeps this down.
  */
-void
-thread_consider_migration(void)
+
+/* Imbalance at which a busy CPU steals in thread_consider_migration */
+#define MIGRATE_MARGIN	2
+
+/*
+ * Take half the difference between our waiting threads and those of
+ * the busiest other CPU, if that is at least MARGIN. Returns the
+ * number of threads taken.
+ */
+static
+unsigned
+thread_steal(unsigned margin)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	unsigned i, numcpus, mine, count, best_count, n;
+	struct cpu *c, *best;
+	struct threadlist stolen;
 	struct thread *t;
 
-	my_count = total_count = 0;
+	mine = curcpu->c_runcount;
+	best = NULL;
+	best_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		count = c->c_runcount;
+		if (c != curcpu->c_self && count > best_count) {
+			best = c;
+			best_count = count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (best == NULL || best_count < mine + margin) {
+		return 0;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_init(&stolen);
+	n = 0;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+	spinlock_acquire(&best->c_runqueue_lock);
+	count = best->c_runcount;
+	if (!best->c_isidle && count >= mine + margin) {
+		n = (count - mine + 1) / 2;
+		for (i=0; i<n; i++) {
+			t = runqueue_remtail(best);
+			KASSERT(t != NULL);
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * Ordinarily, a cpu's curthread will not appear
+			 * on its run queue. However, it can if it went
+			 * to sleep, the cpu went idle with it still
+			 * curthread, and it was woken again before the
+			 * cpu got going. We skip idle victims, but it
+			 * costs nothing to make sure; *migrating* such a
+			 * thread would run it on two stacks at once.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+			if (t == best->c_curthread ||
+			    (margin > 1 && best->c_hardclocks - t->t_lastran
+					   < CACHE_HOT_TICKS)) {
+				runqueue_add(best, t);
+				n = i;
+				break;
 			}
+			t->t_cpu = curcpu->c_self;
+			threadlist_addhead(&stolen, t);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	spinlock_release(&best->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (n == 0) {
+		threadlist_cleanup(&stolen);
+		return 0;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		runqueue_add(curcpu, t);
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, best->c_number, curcpu->c_number);
 	}
+	curcpu->c_steals++;
+	curcpu->c_stolen += n;
+	spinlock_release(&curcpu->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	threadlist_cleanup(&stolen);
+	return n;
+}
+
+/*
+ * This is called periodically from hardclock(). If some other CPU has
+ * MIGRATE_MARGIN or more threads waiting than we do, take half the
+ * difference.
+ */
+void
+thread_consider_migration(void)
+{
+	(void)thread_steal(MIGRATE_MARGIN);
+}
+
+/*
+ * Per-CPU scheduler statistics, for the cpustat menu command.
+ */
+void
+thread_printstats(void)
+{
+	unsigned i, numcpus, busy;
+	struct cpu *c;
+
+	kprintf("%4s %8s %6s %8s %8s %8s %8s %8s %8s\n", "cpu", "ticks",
+		"busy%", "steals", "stolen", "wakeups", "remote", "migrated",
+		"ipis");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		busy = c->c_statclocks == 0 ? 0 :
+			(c->c_statclocks - c->c_idleclocks) * 100 /
+			c->c_statclocks;
+		kprintf("%4u %8u %5u%% %8u %8u %8u %8u %8u %8u\n",
+			c->c_number, c->c_statclocks, busy, c->c_steals,
+			c->c_stolen, c->c_wakeups, c->c_remote_wakeups,
+			c->c_migrations, c->c_unidle_ipis);
+	}
+}
+
+void
+thread_resetstats(void)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		c->c_statclocks = 0;
+		c->c_idleclocks = 0;
+		c->c_steals = 0;
+		c->c_stolen = 0;
+		c->c_wakeups = 0;
+		c->c_remote_wakeups = 0;
+		c->c_migrations = 0;
+		c->c_unidle_ipis = 0;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1162,26 +1651,113 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue N shootdowns on TARGET and poke it with a single IPI. If its
+ * queue fills up, it gets TLBSHOOTDOWN_ALL instead. Returns a ticket
+ * to hand to ipi_tlbshootdown_wait.
+ */
+static
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
 {
-	int n;
+	unsigned i, ticket;
+	int m;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		m = target->c_numshootdown;
+		if (m == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (m == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[m] = mappings[i];
+		target->c_numshootdown = m+1;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
+	ticket = target->c_shootdowns_done;
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	(void)ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+/*
+ * Wait until TARGET has processed everything queued on it as of
+ * TICKET. The lock is dropped on every pass so that interrupts get
+ * in; the target may well be shooting at us at the same time.
+ */
+static
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	while (target->c_shootdowns_done == ticket) {
+		spinlock_release(&target->c_ipi_lock);
+		spinlock_acquire(&target->c_ipi_lock);
+	}
+	spinlock_release(&target->c_ipi_lock);
+}
+
+/*
+ * Carry out the N shootdowns in MAPPINGS on every cpu whose bit is
+ * set in CPUMASK (the current cpu directly, the rest by IPI) and wait
+ * until they have all been done. Returns the number of IPIs sent.
+ *
+ * Must not be called with spinlocks held.
+ */
+unsigned
+ipi_tlbshootdown_sync(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned tickets[32];
+	unsigned i, j, num, sent;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	num = cpuarray_num(&allcpus);
+	KASSERT(num <= 32);
+	sent = 0;
+
+	spl = splhigh();
+	for (i=0; i<num; i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			for (j=0; j<n; j++) {
+				vm_tlbshootdown(&mappings[j]);
+			}
+			cpumask &= ~((uint32_t)1 << i);
+			continue;
+		}
+		tickets[i] = ipi_tlbshootdown_batch(c, mappings, n);
+		sent++;
+	}
+	splx(spl);
+
+	for (i=0; i<num; i++) {
+		if (cpumask & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown_wait(cpuarray_get(&allcpus, i),
+					      tickets[i]);
+		}
+	}
+	return sent;
 }
 
 void
@@ -1217,10 +1793,16 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
 			}
+		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -29,6 +29,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <spl.h>
 #include <lib.h>
 #include <addrspace.h>
@@ -36,6 +37,11 @@
 #include <proc.h>
 #include <mips/tlb.h>
 #include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+
+static int as_writeback_region(struct addrspace *as, struct region *r, vaddr_t start, vaddr_t end);
+static void as_index_regions(struct addrspace *as);
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -56,9 +62,21 @@ as_create(void)
 	 * Initialize as needed.
 	 */
 	as->start_region = NULL;
-	as->start_page_table = NULL;
+	as->region_index = NULL;
+	as->region_count = 0;
+	as->region_index_size = 0;
+	as->region_hint = NULL;
 	as->heap_start = 0;
 	as->heap_end = 0;
+	for (unsigned i = 0; i < MAXCPUS; i++) {
+		as->asid[i] = 0;
+		as->asid_generation[i] = 0;
+	}
+
+	if (pt_create(as)) {
+		kfree(as);
+		return NULL;
+	}
 	return as;
 }
 
@@ -68,58 +86,73 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
         return ENOMEM;
     }
 
-    struct page_table_entry *old_pte = old->start_page_table;
-    struct page_table_entry **new_pte_next = &newas->start_page_table;
-
-    // Copy page table entries
-    while (old_pte != NULL) {
-        struct page_table_entry *new_pte = kmalloc(sizeof(struct page_table_entry));
-        if (new_pte == NULL) {
-            as_destroy(newas);
-            return ENOMEM;
+    /*
+     * The pages of a shared mapping are shared through their PTEs, so
+     * any that nobody has touched yet get an empty one now, filled in
+     * by whichever sharer touches the page first (see vm_fault_fill).
+     * Otherwise parent and child would each fault in a page of their
+     * own later, and never see each other's writes. No frames are
+     * allocated and nothing is read, and a page keeps its PTE across
+     * later forks.
+     */
+    for (struct region *r = old->start_region; r != NULL; r = r->next) {
+        if (!r->shared) {
+            continue;
         }
-
-        new_pte->lock = lock_create("pte_lock");
-        if (new_pte->lock == NULL) {
-            kfree(new_pte);
-            as_destroy(newas);
-            return ENOMEM;
+        for (size_t i = 0; i < r->npages; i++) {
+            vaddr_t vaddr = r->start + i * PAGE_SIZE;
+            if (pt_lookup(old, vaddr) != NULL) {
+                continue;
+            }
+            struct page_table_entry *pte = pte_create(vaddr);
+            if (pte == NULL || pt_insert(old, vaddr, pte)) {
+                if (pte != NULL) {
+                    pte_destroy(pte);
+                }
+                as_destroy(newas);
+                return ENOMEM;
+            }
         }
+    }
 
-        lock_acquire(new_pte->lock);
-        new_pte->as_vpage = old_pte->as_vpage;
-        new_pte->vpage_permission = old_pte->vpage_permission;
-        new_pte->state = UNMAPPED;
-        new_pte->next = NULL;
-
-        paddr_t new_ppage = allocate_user_page(1, newas, new_pte->as_vpage, true);
-        if (new_ppage == 0) {
-            lock_release(new_pte->lock);
-            lock_destroy(new_pte->lock);
-            as_destroy(newas);
-            return ENOMEM;
+    /*
+     * Share every page with the child copy-on-write: both page tables
+     * point at the same PTE and nothing is copied until somebody
+     * writes. This makes fork cost proportional to the number of page
+     * table entries rather than to the amount of memory behind them.
+     */
+    for (unsigned int d = 0; d < PT_DIR_ENTRIES; d++) {
+        struct page_table *old_table = old->page_directory[d];
+        if (old_table == NULL) {
+            continue;
         }
 
-        lock_acquire(old_pte->lock);
-        if (old_pte->state == SWAPPED) {
-            if (read_swap_disk(new_ppage, old_pte->diskpage_location, false)) {
-                panic("Cannot read from swap disk");
+        for (unsigned int t = 0; t < PT_TABLE_ENTRIES; t++) {
+            struct page_table_entry *pte = old_table->pt_entries[t];
+            if (pte == NULL) {
+                continue;
             }
-        } else {
-            memmove((void *)PADDR_TO_KVADDR(new_ppage),
-                    (const void *)PADDR_TO_KVADDR(old_pte->as_ppage), PAGE_SIZE);
-        }
-        lock_release(old_pte->lock);
 
-        new_pte->as_ppage = new_ppage;
-        new_pte->state = MAPPED;
-        lock_release(new_pte->lock);
+            pte_lock(pte);
+            if (pte->refcount == PTE_REFCOUNT_MAX) {
+                pte_unlock(pte);
+                as_destroy(newas);
+                return ENOMEM;
+            }
+            pte->refcount++;
+            pte_unlock(pte);
 
-        *new_pte_next = new_pte;
-        new_pte_next = &new_pte->next;
-        old_pte = old_pte->next;
+            if (pt_insert(newas, PTE_VADDR(pte), pte)) {
+                pte_release(pte);
+                as_destroy(newas);
+                return ENOMEM;
+            }
+        }
     }
 
+    // The parent's TLBs may still hold writable mappings of what are now shared pages
+    tlb_invalidate_as(old);
+
     // Copy regions
     struct region *old_region = old->start_region;
     struct region **new_region_next = &newas->start_region;
@@ -138,11 +171,21 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
         new_region->read = old_region->read;
         new_region->write = old_region->write;
         new_region->execute = old_region->execute;
+        new_region->vnode = old_region->vnode;
+        new_region->file_vaddr = old_region->file_vaddr;
+        new_region->file_offset = old_region->file_offset;
+        new_region->file_size = old_region->file_size;
+        new_region->mmapped = old_region->mmapped;
+        new_region->shared = old_region->shared;
         new_region->next = NULL;
+        if (new_region->vnode != NULL) {
+            VOP_INCREF(new_region->vnode);
+        }
 
         new_region_next = &new_region->next;
         old_region = old_region->next;
     }
+    as_index_regions(newas);
 
     // Copy heap information
     newas->heap_start = old->heap_start;
@@ -155,50 +198,84 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 void as_destroy(struct addrspace *as) {
     KASSERT(as != NULL);
 
-    // Clean up page table entries
-    struct page_table_entry *current_pte = as->start_page_table;
-    struct page_table_entry *next_pte;
-
-    while (current_pte != NULL) {
-        lock_acquire(current_pte->lock);
-
-        if (current_pte->state == SWAPPED) {
-            // Unmark the swapped page in the swap bitmap
-            unmark_swap_bitmap(current_pte->diskpage_location);
-        } else if (current_pte->state == MAPPED) {
-            // Release the physical page
-            int err = release_physical_page(current_pte->as_ppage);
-            if (err) {
-                // If release failed, skip cleanup for this PTE
-                lock_release(current_pte->lock);
-                current_pte = current_pte->next;
-                continue;
-            }
-        }
-
-        lock_release(current_pte->lock);
-
-        // Destroy the lock and free the PTE
-        next_pte = current_pte->next;
-        lock_destroy(current_pte->lock);
-        kfree(current_pte);
-        current_pte = next_pte;
+    // Shared file mappings go back to their files before the pages go
+    for (struct region *r = as->start_region; r != NULL; r = r->next) {
+        as_writeback_region(as, r, r->start, r->start + r->size);
     }
 
+    as_unmap_range(as, 0, USERSPACETOP);
+    pt_destroy(as);
+
     // Clean up region list
     struct region *current_region = as->start_region;
     struct region *next_region;
 
     while (current_region != NULL) {
         next_region = current_region->next;
+        if (current_region->vnode != NULL) {
+            VOP_DECREF(current_region->vnode);
+        }
         kfree(current_region);
         current_region = next_region;
     }
+    kfree(as->region_index);
 
     // Free the address space itself
     kfree(as);
 }
 
+/*
+ * Walks the page table directly, skipping second-level tables that
+ * were never allocated, and hands the PTEs it takes out to
+ * pte_release_batch PTE_BATCH at a time.
+ *
+ * The TLBs are dealt with once for the whole range, before any frame
+ * is let go. Pages only ever read are mapped to the zero page with no
+ * PTE, so this is done whether or not a page has one. An address space
+ * that is not ours is dead and needs nothing: its ASIDs are not handed
+ * out again until the next rollover flushes the TLB.
+ */
+void as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end) {
+    struct page_table_entry *batch[PTE_BATCH];
+    unsigned int n = 0;
+
+    KASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+    KASSERT(start <= end && end <= USERSPACETOP);
+
+    if (as == proc_getas()) {
+        tlb_invalidate_range(start, end);
+        tlb_invalidate_as_elsewhere(as);
+    }
+
+    vaddr_t vaddr = start;
+    while (vaddr < end) {
+        unsigned int d = PT_DIR_INDEX(vaddr);
+        vaddr_t table_end = PT_VADDR(d + 1, 0);
+        if (table_end > end) {
+            table_end = end;
+        }
+
+        struct page_table *table = as->page_directory[d];
+        for (; table != NULL && vaddr < table_end; vaddr += PAGE_SIZE) {
+            struct page_table_entry **slot = &table->pt_entries[PT_TABLE_INDEX(vaddr)];
+            if (*slot == NULL) {
+                continue;
+            }
+            batch[n++] = *slot;
+            *slot = NULL;
+            if (n == PTE_BATCH) {
+                pte_release_batch(batch, n);
+                n = 0;
+            }
+        }
+        vaddr = table_end;
+    }
+
+    if (n > 0) {
+        pte_release_batch(batch, n);
+    }
+}
+
 void as_activate(void) {
     // Get the current address space
     struct addrspace *current_as = proc_getas();
@@ -206,16 +283,8 @@ void as_activate(void) {
         return; // No address space; kernel thread does not require TLB updates
     }
 
-    // Temporarily disable interrupts
-    int spl = splhigh();
-
-    // Clear the TLB entries using an efficient loop
-    for (int i = 0; i < NUM_TLB; i++) {
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-    }
-
-    // Re-enable interrupts
-    splx(spl);
+    // Entries are tagged with the ASID, so the TLB only needs a flush on rollover
+    tlb_activate(current_as);
 }
 
 
@@ -229,6 +298,78 @@ as_deactivate(void)
 	 */
 }
 
+/*
+ * Rebuild AS's index of its regions after they have changed. If there
+ * is no memory for it, lookups walk the list instead.
+ */
+static void as_index_regions(struct addrspace *as) {
+    unsigned int count = 0;
+    for (struct region *r = as->start_region; r != NULL; r = r->next) {
+        count++;
+    }
+
+    as->region_hint = NULL;
+    if (count > as->region_index_size) {
+        unsigned int size = as->region_index_size > 0 ? as->region_index_size : 8;
+        while (size < count) {
+            size *= 2;
+        }
+        kfree(as->region_index);
+        as->region_index = kmalloc(size * sizeof(struct region *));
+        as->region_index_size = as->region_index != NULL ? size : 0;
+    }
+    if (as->region_index == NULL) {
+        as->region_count = 0;
+        return;
+    }
+
+    count = 0;
+    for (struct region *r = as->start_region; r != NULL; r = r->next) {
+        as->region_index[count++] = r;
+    }
+    as->region_count = count;
+}
+
+/* Link REGION into AS's list in address order, after any at the same start */
+static void as_insert_region(struct addrspace *as, struct region *region) {
+    struct region **rp = &as->start_region;
+    while (*rp != NULL && (*rp)->start <= region->start) {
+        rp = &(*rp)->next;
+    }
+    region->next = *rp;
+    *rp = region;
+    as_index_regions(as);
+}
+
+/*
+ * The first region, in address order, that ends above VADDR; if any
+ * region contains VADDR, this is the lowest one that does. Since
+ * regions do not nest, their ends are sorted like their starts, so
+ * this is a binary search on the index.
+ */
+static struct region *as_region_from(struct addrspace *as, vaddr_t vaddr) {
+    if (as->region_index == NULL) {
+        struct region *r = as->start_region;
+        while (r != NULL && r->start + r->size <= vaddr) {
+            r = r->next;
+        }
+        return r;
+    }
+
+    unsigned int lo = 0;
+    unsigned int hi = as->region_count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        struct region *r = as->region_index[mid];
+        if (r->start + r->size <= vaddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < as->region_count ? as->region_index[lo] : NULL;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -262,22 +403,333 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
     new_region->read = (readable & 4) != 0;
     new_region->write = (writeable & 2) != 0;
     new_region->execute = (executable & 1) != 0;
-    new_region->next = NULL;
-
-    // Insert the region into the list
-    if (as->start_region == NULL) {
-        as->start_region = new_region;
-    } else {
-        struct region *last = as->start_region;
-        while (last->next != NULL) {
-            last = last->next;
+    new_region->vnode = NULL;
+    new_region->file_vaddr = 0;
+    new_region->file_offset = 0;
+    new_region->file_size = 0;
+    new_region->mmapped = false;
+    new_region->shared = false;
+
+    as_insert_region(as, new_region);
+    return 0;
+}
+
+/*
+ * Nothing is read here; vm_fault pulls the pages in as they are first
+ * touched, so exec only pays for the part of the image that is used.
+ * The region keeps a reference to V.
+ */
+int as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+                   struct vnode *v, off_t offset) {
+    KASSERT(as != NULL);
+
+    // Nothing will uiomove this in, so check for kernel addresses here
+    if (vaddr + filesize < vaddr || vaddr + filesize > USERSPACETOP) {
+        return EFAULT;
+    }
+
+    for (struct region *r = as->start_region; r != NULL; r = r->next) {
+        if (r->start == (vaddr & PAGE_FRAME) && r->vnode == NULL) {
+            if (vaddr + filesize > r->start + r->size) {
+                return EINVAL;
+            }
+            VOP_INCREF(v);
+            r->vnode = v;
+            r->file_vaddr = vaddr;
+            r->file_offset = offset;
+            r->file_size = filesize;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+/*
+ * The part LO..HI of the page at VADDR that R fills from its file, if
+ * any. munmap may have cut R down, hence the clipping to R itself.
+ */
+static bool region_file_span(struct region *r, vaddr_t vaddr, vaddr_t *lo, vaddr_t *hi) {
+    if (r->vnode == NULL) {
+        return false;
+    }
+
+    *lo = vaddr;
+    *hi = vaddr + PAGE_SIZE;
+    if (*lo < r->file_vaddr) {
+        *lo = r->file_vaddr;
+    }
+    if (*lo < r->start) {
+        *lo = r->start;
+    }
+    if (*hi > r->file_vaddr + r->file_size) {
+        *hi = r->file_vaddr + r->file_size;
+    }
+    if (*hi > r->start + r->size) {
+        *hi = r->start + r->size;
+    }
+    return *lo < *hi;
+}
+
+/*
+ * Segments need not start or end on page boundaries, so a page may
+ * hold the tail of one and the head of the next; read every piece.
+ * KBUF must come zeroed; the parts not read stay that way.
+ */
+int as_read_file_page(struct addrspace *as, vaddr_t vaddr, void *kbuf, bool *backed) {
+    KASSERT(as != NULL);
+    KASSERT((vaddr & ~(vaddr_t)PAGE_FRAME) == 0);
+
+    *backed = false;
+    for (struct region *r = as_region_from(as, vaddr);
+         r != NULL && r->start < vaddr + PAGE_SIZE; r = r->next) {
+        if (r->vnode == NULL) {
+            continue;
+        }
+
+        vaddr_t lo, hi;
+        if (!region_file_span(r, vaddr, &lo, &hi)) {
+            continue;
+        }
+
+        *backed = true;
+        if (kbuf == NULL) {
+            return 0;
+        }
+
+        struct iovec iov;
+        struct uio ku;
+        uio_kinit(&iov, &ku, (char *)kbuf + (lo - vaddr), hi - lo,
+                  r->file_offset + (lo - r->file_vaddr), UIO_READ);
+        int result = VOP_READ(r->vnode, &ku);
+        if (result) {
+            return result;
+        }
+        if (ku.uio_resid != 0) {
+            // The executable shrank under us
+            return EIO;
+        }
+    }
+    return 0;
+}
+
+bool as_text_page(struct addrspace *as, vaddr_t vaddr, struct vnode **v, off_t *offset) {
+    struct region *text = NULL;
+
+    for (struct region *r = as_region_from(as, vaddr);
+         r != NULL && r->start < vaddr + PAGE_SIZE; r = r->next) {
+        vaddr_t lo, hi;
+        if (!region_file_span(r, vaddr, &lo, &hi)) {
+            continue;
+        }
+        if (text != NULL || r->write || r->mmapped) {
+            // Shares the page with another segment, is data, or is mmapped
+            return false;
+        }
+        text = r;
+    }
+    if (text == NULL) {
+        return false;
+    }
+
+    *v = text->vnode;
+    *offset = text->file_offset + ((off_t)vaddr - (off_t)text->file_vaddr);
+    return true;
+}
+
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr) {
+    // Faults tend to come in runs on the same region
+    struct region *r = as->region_hint;
+    if (r != NULL && vaddr >= r->start && vaddr < r->start + r->size) {
+        return r;
+    }
+
+    r = as_region_from(as, vaddr);
+    if (r == NULL || vaddr < r->start) {
+        return NULL;
+    }
+    as->region_hint = r;
+    return r;
+}
+
+bool as_range_free(struct addrspace *as, vaddr_t start, vaddr_t end) {
+    struct region *r = as_region_from(as, start);
+    return r == NULL || r->start >= end;
+}
+
+/*
+ * Write back to the file those pages of shared file mapping R in
+ * START..END that have been written. Returns the first error, but
+ * carries on with the other pages regardless.
+ */
+static int as_writeback_region(struct addrspace *as, struct region *r, vaddr_t start, vaddr_t end) {
+    int first_error = 0;
+
+    if (!r->shared || r->vnode == NULL) {
+        return 0;
+    }
+
+    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        vaddr_t lo, hi;
+        struct page_table_entry *pte = pt_lookup(as, vaddr);
+        if (pte == NULL || !region_file_span(r, vaddr, &lo, &hi)) {
+            continue;
         }
-        last->next = new_region;
+
+        // Mappings start at a page-aligned file offset, so pages do too
+        KASSERT(lo == vaddr);
+        int result = vm_writeback_page(pte, r->vnode,
+                                       r->file_offset + (off_t)(vaddr - r->file_vaddr),
+                                       hi - lo);
+        if (result && first_error == 0) {
+            first_error = result;
+        }
+    }
+    return first_error;
+}
+
+/*
+ * Mappings are placed top-down from just below the stack, in the
+ * highest gap big enough, so that they stay out of the way of the
+ * heap growing up. The gaps are found in one pass up the sorted
+ * region list.
+ */
+int as_mmap(struct addrspace *as, size_t len, int prot, bool shared, struct vnode *v,
+            off_t offset, size_t filesize, vaddr_t *ret) {
+    KASSERT(as != NULL);
+
+    size_t size = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if (size == 0 || size < len) {
+        return EINVAL;
     }
 
+    vaddr_t top = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+    vaddr_t gap_start = as->heap_end;
+    vaddr_t start = 0;
+    bool found = false;
+    for (struct region *r = as->start_region; ; r = r->next) {
+        vaddr_t gap_end = (r == NULL || r->start > top) ? top : r->start;
+        if (gap_end > gap_start && gap_end - gap_start >= size) {
+            start = gap_end - size;
+            found = true;
+        }
+        if (r == NULL || r->start >= top) {
+            break;
+        }
+        if (r->start + r->size > gap_start) {
+            gap_start = r->start + r->size;
+        }
+    }
+    if (!found) {
+        return ENOMEM;
+    }
+
+    struct region *region = kmalloc(sizeof(struct region));
+    if (region == NULL) {
+        return ENOMEM;
+    }
+    region->start = start;
+    region->size = size;
+    region->npages = size / PAGE_SIZE;
+    region->read = (prot & PROT_READ) != 0;
+    region->write = (prot & PROT_WRITE) != 0;
+    region->execute = (prot & PROT_EXEC) != 0;
+    region->vnode = v;
+    region->file_vaddr = start;
+    region->file_offset = offset;
+    region->file_size = v != NULL ? filesize : 0;
+    region->mmapped = true;
+    region->shared = shared;
+    if (v != NULL) {
+        VOP_INCREF(v);
+    }
+
+    as_insert_region(as, region);
+
+    *ret = start;
     return 0;
 }
 
+/*
+ * Unmapping part of a region splits it; both parts keep the same file
+ * placement (file_vaddr and file_offset), so nothing else changes.
+ */
+int as_munmap(struct addrspace *as, vaddr_t addr, size_t len) {
+    KASSERT(as != NULL);
+
+    if ((addr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0) {
+        return EINVAL;
+    }
+    vaddr_t end = (addr + len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if (end <= addr || end > USERSPACETOP) {
+        return EINVAL;
+    }
+
+    int first_error = 0;
+    struct region **rp = &as->start_region;
+    while (*rp != NULL) {
+        struct region *r = *rp;
+        vaddr_t r_end = r->start + r->size;
+
+        if (!r->mmapped || end <= r->start || r_end <= addr) {
+            rp = &r->next;
+            continue;
+        }
+
+        vaddr_t lo = addr > r->start ? addr : r->start;
+        vaddr_t hi = end < r_end ? end : r_end;
+
+        // Punching a hole makes the part above a region of its own
+        struct region *upper = NULL;
+        if (lo > r->start && hi < r_end) {
+            upper = kmalloc(sizeof(struct region));
+            if (upper == NULL) {
+                first_error = ENOMEM;
+                break;
+            }
+        }
+
+        int result = as_writeback_region(as, r, lo, hi);
+        if (result && first_error == 0) {
+            first_error = result;
+        }
+
+        as_unmap_range(as, lo, hi);
+
+        if (upper != NULL) {
+            *upper = *r;
+            upper->start = hi;
+            upper->size = r_end - hi;
+            upper->npages = upper->size / PAGE_SIZE;
+            if (upper->vnode != NULL) {
+                VOP_INCREF(upper->vnode);
+            }
+            r->size = lo - r->start;
+            r->npages = r->size / PAGE_SIZE;
+            r->next = upper;
+            rp = &upper->next;
+        } else if (lo > r->start) {
+            r->size = lo - r->start;
+            r->npages = r->size / PAGE_SIZE;
+            rp = &r->next;
+        } else if (hi < r_end) {
+            r->start = hi;
+            r->size = r_end - hi;
+            r->npages = r->size / PAGE_SIZE;
+            rp = &r->next;
+        } else {
+            *rp = r->next;
+            if (r->vnode != NULL) {
+                VOP_DECREF(r->vnode);
+            }
+            kfree(r);
+        }
+    }
+
+    // as_unmap_range has already dropped the translations everywhere
+    as_index_regions(as);
+    return first_error;
+}
+
 int as_prepare_load(struct addrspace *as) {
     KASSERT(as != NULL);
 
@@ -0,0 +1,126 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * Page cache for program text.
+ *
+ * Every process running the same binary would otherwise read its own
+ * copy of the code. Instead, the first one to touch a read-only page
+ * of an executable enters its PTE here, keyed by vnode, file offset
+ * and virtual address, and later ones map that same PTE, exactly the
+ * way a page is shared copy-on-write after fork. The shared PTE is the
+ * reverse mapping: eviction and swap-in act on it once for everybody,
+ * and its tlb_cpus covers all the mappers.
+ *
+ * The cache holds no reference of its own. An entry lives as long as
+ * some page table holds its PTE; pte_release takes it out when the
+ * last reference goes. A lookup that finds a PTE whose refcount has
+ * already dropped to 0, or that cannot take another reference, treats
+ * it as a miss.
+ *
+ * Lock order is pagecache_lock, then a PTE's lock. Nobody takes
+ * pagecache_lock while holding a PTE lock.
+ */
+
+#define PAGECACHE_BUCKETS 256
+
+struct pagecache_entry {
+    struct vnode *vnode;
+    off_t offset;
+    vaddr_t vaddr;
+    struct page_table_entry *pte;
+    struct pagecache_entry *next;
+};
+
+static struct pagecache_entry *buckets[PAGECACHE_BUCKETS];
+static struct lock *pagecache_lock;
+
+/*
+ * Hashed on the virtual page alone, so that pte_release can find the
+ * entry from the PTE. A chain holds one entry per distinct binary
+ * using that page, which is few.
+ */
+static unsigned int pagecache_hash(vaddr_t vaddr) {
+    return (vaddr / PAGE_SIZE) % PAGECACHE_BUCKETS;
+}
+
+void pagecache_bootstrap(void) {
+    pagecache_lock = lock_create("pagecache");
+    if (pagecache_lock == NULL) {
+        panic("pagecache_bootstrap: Out of memory\n");
+    }
+}
+
+struct page_table_entry *pagecache_lookup(struct vnode *v, off_t offset, vaddr_t vaddr) {
+    struct page_table_entry *found = NULL;
+
+    lock_acquire(pagecache_lock);
+    for (struct pagecache_entry *e = buckets[pagecache_hash(vaddr)];
+         e != NULL; e = e->next) {
+        if (e->vnode != v || e->offset != offset || e->vaddr != vaddr) {
+            continue;
+        }
+
+        pte_lock(e->pte);
+        if (e->pte->refcount > 0 && e->pte->refcount < PTE_REFCOUNT_MAX) {
+            e->pte->refcount++;
+            found = e->pte;
+        }
+        pte_unlock(e->pte);
+        if (found != NULL) {
+            break;
+        }
+    }
+    lock_release(pagecache_lock);
+
+    return found;
+}
+
+int pagecache_insert(struct vnode *v, off_t offset, struct page_table_entry *pte) {
+    unsigned int bucket = pagecache_hash(PTE_VADDR(pte));
+
+    struct pagecache_entry *entry = kmalloc(sizeof(struct pagecache_entry));
+    if (entry == NULL) {
+        return ENOMEM;
+    }
+    entry->vnode = v;
+    entry->offset = offset;
+    entry->vaddr = PTE_VADDR(pte);
+    entry->pte = pte;
+
+    lock_acquire(pagecache_lock);
+    for (struct pagecache_entry *e = buckets[bucket]; e != NULL; e = e->next) {
+        if (e->vnode == v && e->offset == offset && e->vaddr == PTE_VADDR(pte)) {
+            // Somebody else read the same page in meanwhile
+            lock_release(pagecache_lock);
+            kfree(entry);
+            return EEXIST;
+        }
+    }
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    lock_release(pagecache_lock);
+
+    return 0;
+}
+
+void pagecache_remove(struct page_table_entry *pte) {
+    struct pagecache_entry *victim = NULL;
+
+    lock_acquire(pagecache_lock);
+    for (struct pagecache_entry **ep = &buckets[pagecache_hash(PTE_VADDR(pte))];
+         *ep != NULL; ep = &(*ep)->next) {
+        if ((*ep)->pte == pte) {
+            victim = *ep;
+            *ep = victim->next;
+            break;
+        }
+    }
+    lock_release(pagecache_lock);
+
+    kfree(victim);
+}
@@ -0,0 +1,256 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <current.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * Two-level page table.
+ *
+ * The directory and each second-level table are exactly one page of
+ * pointers, so a lookup is two array indexings no matter how many
+ * pages the process has resident. Second-level tables are allocated
+ * the first time a PTE is inserted into their 4M slice of the address
+ * space and freed with the address space.
+ *
+ * The page table belongs to the process that owns the address space;
+ * only that process (or as_copy/as_destroy on its behalf) changes its
+ * shape, so no locking is done here. The evictor never walks it: it
+ * reaches PTEs through the coremap.
+ */
+
+/*
+ * PTE locks. A PTE is locked by setting its busy bit; a thread that
+ * finds it set sleeps on the wait channel of the PTE's bucket, and
+ * unlocking wakes everybody waiting there if anybody is. A few dozen
+ * buckets shared by all PTEs take the place of a struct lock, with its
+ * name and wait channel, per PTE. The busy bit is only changed under
+ * its bucket's spinlock.
+ */
+#define PTE_LOCK_BUCKETS 64
+
+static struct pte_lock_bucket {
+    struct spinlock pb_lock;
+    struct wchan *pb_wchan;
+    unsigned int pb_waiters;
+} pte_lock_buckets[PTE_LOCK_BUCKETS];
+
+// Page table memory, for vm_printstats
+static struct spinlock pt_stats_lock = SPINLOCK_INITIALIZER;
+static unsigned int pt_pte_count;
+static unsigned int pt_table_count;
+
+static void pt_count(unsigned int *counter, int delta) {
+    spinlock_acquire(&pt_stats_lock);
+    *counter += delta;
+    spinlock_release(&pt_stats_lock);
+}
+
+int pt_create(struct addrspace *as) {
+    as->page_directory = kmalloc(PT_DIR_ENTRIES * sizeof(struct page_table *));
+    if (as->page_directory == NULL) {
+        return ENOMEM;
+    }
+    bzero(as->page_directory, PT_DIR_ENTRIES * sizeof(struct page_table *));
+    pt_count(&pt_table_count, 1);
+    return 0;
+}
+
+void pt_destroy(struct addrspace *as) {
+    if (as->page_directory == NULL) {
+        return;
+    }
+
+    for (unsigned int d = 0; d < PT_DIR_ENTRIES; d++) {
+        struct page_table *table = as->page_directory[d];
+        if (table == NULL) {
+            continue;
+        }
+        for (unsigned int t = 0; t < PT_TABLE_ENTRIES; t++) {
+            KASSERT(table->pt_entries[t] == NULL);
+        }
+        kfree(table);
+        pt_count(&pt_table_count, -1);
+    }
+
+    kfree(as->page_directory);
+    pt_count(&pt_table_count, -1);
+    as->page_directory = NULL;
+}
+
+struct page_table_entry *pt_lookup(struct addrspace *as, vaddr_t vaddr) {
+    struct page_table *table = as->page_directory[PT_DIR_INDEX(vaddr)];
+    if (table == NULL) {
+        return NULL;
+    }
+    return table->pt_entries[PT_TABLE_INDEX(vaddr)];
+}
+
+int pt_insert(struct addrspace *as, vaddr_t vaddr, struct page_table_entry *pte) {
+    struct page_table **slot = &as->page_directory[PT_DIR_INDEX(vaddr)];
+
+    if (*slot == NULL) {
+        *slot = kmalloc(sizeof(struct page_table));
+        if (*slot == NULL) {
+            return ENOMEM;
+        }
+        bzero(*slot, sizeof(struct page_table));
+        pt_count(&pt_table_count, 1);
+    }
+
+    KASSERT((*slot)->pt_entries[PT_TABLE_INDEX(vaddr)] == NULL);
+    (*slot)->pt_entries[PT_TABLE_INDEX(vaddr)] = pte;
+    return 0;
+}
+
+struct page_table_entry *pt_remove(struct addrspace *as, vaddr_t vaddr) {
+    struct page_table *table = as->page_directory[PT_DIR_INDEX(vaddr)];
+    if (table == NULL) {
+        return NULL;
+    }
+
+    struct page_table_entry *pte = table->pt_entries[PT_TABLE_INDEX(vaddr)];
+    table->pt_entries[PT_TABLE_INDEX(vaddr)] = NULL;
+    return pte;
+}
+
+struct page_table_entry *pte_create(vaddr_t vaddr) {
+    struct page_table_entry *pte = kmalloc(sizeof(*pte));
+    if (pte == NULL) {
+        return NULL;
+    }
+
+    pte->vpn = vaddr / PAGE_SIZE;
+    pte->state = UNMAPPED;
+    pte->dirty = false;
+    pte->cached = false;
+    pte->file_dirty = false;
+    pte->busy = false;
+    pte->ppn = 0;
+    pte->refcount = 1;
+    pte->diskpage_location = 0;
+    pte->tlb_cpus = 0;
+    pt_count(&pt_pte_count, 1);
+    return pte;
+}
+
+void pte_destroy(struct page_table_entry *pte) {
+    KASSERT(pte->state == UNMAPPED);
+    KASSERT(!pte->busy);
+    kfree(pte);
+    pt_count(&pt_pte_count, -1);
+}
+
+void pte_release(struct page_table_entry *pte) {
+    pte_lock(pte);
+
+    KASSERT(pte->refcount > 0);
+    pte->refcount--;
+    if (pte->refcount > 0) {
+        // Still mapped copy-on-write by somebody else
+        pte_unlock(pte);
+        return;
+    }
+
+    // Frees the frame or swap slot, waiting out any eviction in flight
+    release_pte_backing(pte);
+
+    pte_unlock(pte);
+    if (pte->cached) {
+        // A lookup seeing refcount 0 leaves it alone until we get here
+        pagecache_remove(pte);
+    }
+    pte_destroy(pte);
+}
+
+/*
+ * pte_release for N PTEs that have already been taken out of the page
+ * table, freeing the backing of the ones that go away in one batch.
+ */
+void pte_release_batch(struct page_table_entry **ptes, unsigned int n) {
+    unsigned int last = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        struct page_table_entry *pte = ptes[i];
+
+        pte_lock(pte);
+        KASSERT(pte->refcount > 0);
+        pte->refcount--;
+        if (pte->refcount == 0) {
+            ptes[last++] = pte;
+        }
+        pte_unlock(pte);
+    }
+
+    // Unlike pte_release we free the backing without the PTE locks, so
+    // the page cache must not be able to hand them out before we do
+    for (unsigned int i = 0; i < last; i++) {
+        if (ptes[i]->cached) {
+            pagecache_remove(ptes[i]);
+        }
+    }
+
+    release_pte_backing_batch(ptes, last);
+
+    for (unsigned int i = 0; i < last; i++) {
+        pte_destroy(ptes[i]);
+    }
+}
+
+void pte_lock_bootstrap(void) {
+    for (unsigned int i = 0; i < PTE_LOCK_BUCKETS; i++) {
+        spinlock_init(&pte_lock_buckets[i].pb_lock);
+        pte_lock_buckets[i].pb_wchan = wchan_create("pte_lock");
+        if (pte_lock_buckets[i].pb_wchan == NULL) {
+            panic("pte_lock_bootstrap: Out of memory\n");
+        }
+        pte_lock_buckets[i].pb_waiters = 0;
+    }
+}
+
+static struct pte_lock_bucket *pte_lock_bucket(struct page_table_entry *pte) {
+    return &pte_lock_buckets[((uintptr_t)pte / sizeof(*pte)) % PTE_LOCK_BUCKETS];
+}
+
+void pte_lock(struct page_table_entry *pte) {
+    struct pte_lock_bucket *b = pte_lock_bucket(pte);
+
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&b->pb_lock);
+    while (pte->busy) {
+        b->pb_waiters++;
+        wchan_sleep(b->pb_wchan, &b->pb_lock);
+        b->pb_waiters--;
+    }
+    pte->busy = true;
+    spinlock_release(&b->pb_lock);
+}
+
+void pte_unlock(struct page_table_entry *pte) {
+    struct pte_lock_bucket *b = pte_lock_bucket(pte);
+
+    spinlock_acquire(&b->pb_lock);
+    KASSERT(pte->busy);
+    pte->busy = false;
+    if (b->pb_waiters > 0) {
+        // They may be waiting for other PTEs; each checks its own
+        wchan_wakeall(b->pb_wchan, &b->pb_lock);
+    }
+    spinlock_release(&b->pb_lock);
+}
+
+bool pte_locked(struct page_table_entry *pte) {
+    return pte->busy;
+}
+
+void pt_memory_usage(unsigned int *ptes, unsigned int *tables) {
+    spinlock_acquire(&pt_stats_lock);
+    *ptes = pt_pte_count;
+    *tables = pt_table_count;
+    spinlock_release(&pt_stats_lock);
+}
@@ -14,6 +14,11 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <bitmap.h>
+#include <wchan.h>
+#include <clock.h>
+#include <thread.h>
+#include <membar.h>
+#include <platform/maxcpus.h>
 #include <kern/fcntl.h>
 
 static paddr_t memory_start, memory_end;
@@ -24,10 +29,456 @@ static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
 struct swap_disk swap;
 static unsigned int eviction_pointer;
 
+/*
+ * A frame of zeros, mapped read-only wherever anonymous memory that
+ * has never been written is read. Such a page gets no PTE: its first
+ * write faults as if it were untouched and gets a frame of its own,
+ * overwriting the zero page's TLB entry in place. The frame is kernel
+ * memory and never evicted, so nothing ever needs to shoot it down;
+ * code that unmaps user pages must drop the TLB entry whether or not
+ * it finds a PTE.
+ */
+static paddr_t zero_page;
+
+// Threads waiting for an in-flight eviction sleep here (under coremap_lock)
+static struct wchan *eviction_wchan;
+
+/*
+ * The pageout daemon sleeps on pageout_wchan until an allocation leaves
+ * fewer than pageout_low free frames, then evicts pages until there
+ * are pageout_high free again, so that faults rarely have to wait for
+ * a swap write themselves. All of this is under coremap_lock.
+ */
+static struct wchan *pageout_wchan;
+static unsigned int pageout_low, pageout_high;
+static bool pageout_active;
+
+/*
+ * Counters are kept per CPU so that counting faults does not itself
+ * serialize the fault path; vm_printstats() adds them up. Allocations
+ * made before thread_bootstrap() have no curcpu, and go uncounted.
+ */
+static struct vm_stats stats[MAXCPUS];
+static struct timespec stats_start;
+
+#define VMSTAT_INC(field) do {              \
+    if (CURCPU_EXISTS()) {                  \
+        int stat_spl = splhigh();           \
+        stats[curcpu->c_number].field++;    \
+        splx(stat_spl);                     \
+    }                                       \
+} while (0)
+
+#define VMSTAT_ADD(field, n) do {           \
+    if (CURCPU_EXISTS()) {                  \
+        int stat_spl = splhigh();           \
+        stats[curcpu->c_number].field += (n); \
+        splx(stat_spl);                     \
+    }                                       \
+} while (0)
+
+/*
+ * Address space IDs. Each CPU hands out ASIDs 1..NUM_ASID-1 to address
+ * spaces as they are activated on it. When it runs out it starts a new
+ * generation: the TLB is flushed, numbering starts over, and address
+ * spaces still holding an ASID from an older generation get a new one
+ * the next time they are activated. Since an ASID is only ever reused
+ * after a flush, entries left behind by dead address spaces are
+ * harmless. ASIDs are per CPU, so a rollover only concerns the CPU's
+ * own TLB. All of this is only touched with interrupts off.
+ */
+static unsigned int asid_next[MAXCPUS];
+static unsigned int asid_generation[MAXCPUS];
+static unsigned int asid_current[MAXCPUS];
+
+/*
+ * Swap I/O is done in clusters of up to SWAP_CLUSTER pages: eviction
+ * writes several victims from one address space to consecutive slots
+ * at once, and a fault on a swapped page reads the pages in the slots
+ * after it along with it. Cluster mates for an eviction are looked for
+ * among the SWAP_CLUSTER_WINDOW frames following the victim.
+ */
+#define SWAP_CLUSTER        8
+#define SWAP_CLUSTER_WINDOW 32
+
+static int swap_io(const paddr_t *frames, unsigned int n, unsigned int slot, enum uio_rw rw);
+static void tlb_shootdown_frames(const paddr_t *frames, unsigned int n, uint32_t cpumask);
+
+/*
+ * Free frames are kept by a buddy allocator layered over the coremap:
+ * free_lists[k] holds the free blocks of 2^k frames, each aligned to
+ * its size. A block is identified by its first frame, whose chunk_size
+ * is the block length. Frame 0 always holds the kernel, so 0 doubles
+ * as the list terminator.
+ *
+ * Single frames come straight off free_lists[0] unless a larger block
+ * has to be split; a kernel allocation of n frames takes the smallest
+ * block of at least n and gives back the tail it does not need.
+ */
+#define FRAME_MAX_ORDER 16
+
+static unsigned int free_lists[FRAME_MAX_ORDER + 1];
+static unsigned int first_frame, end_frame;
+
+static void freelist_push(unsigned int idx, unsigned int order) {
+    coremap[idx].chunk_size = 1 << order;
+    coremap[idx].free_prev = 0;
+    coremap[idx].free_next = free_lists[order];
+    if (free_lists[order] != 0) {
+        coremap[free_lists[order]].free_prev = idx;
+    }
+    free_lists[order] = idx;
+}
+
+static void freelist_remove(unsigned int idx, unsigned int order) {
+    unsigned int next = coremap[idx].free_next;
+    unsigned int prev = coremap[idx].free_prev;
+
+    if (prev != 0) {
+        coremap[prev].free_next = next;
+    } else {
+        KASSERT(free_lists[order] == idx);
+        free_lists[order] = next;
+    }
+    if (next != 0) {
+        coremap[next].free_prev = prev;
+    }
+    coremap[idx].chunk_size = 0;
+}
+
+/*
+ * Put the block of 2^ORDER frames at IDX on the free lists, merging it
+ * with its buddy for as long as the buddy is free too.
+ */
+static void frame_free_block(unsigned int idx, unsigned int order) {
+    while (order < FRAME_MAX_ORDER) {
+        unsigned int size = 1 << order;
+        unsigned int buddy = idx ^ size;
+
+        if (buddy < first_frame || buddy + size > end_frame) {
+            break;
+        }
+        if (coremap[buddy].state != free || coremap[buddy].chunk_size != (int)size) {
+            break;
+        }
+        freelist_remove(buddy, order);
+        if (buddy < idx) {
+            idx = buddy;
+        }
+        order++;
+    }
+    freelist_push(idx, order);
+}
+
+/*
+ * Return NPAGES frames starting at IDX to the allocator, as the largest
+ * aligned blocks that tile the range.
+ */
+static void frame_free_range(unsigned int idx, unsigned int npages) {
+    for (unsigned int i = 0; i < npages; i++) {
+        coremap[idx + i] = (struct coremap_page){ .state = free, .chunk_size = 0 };
+    }
+
+    while (npages > 0) {
+        unsigned int order = 0;
+        while (order < FRAME_MAX_ORDER &&
+               idx % (2u << order) == 0 && (2u << order) <= npages) {
+            order++;
+        }
+        frame_free_block(idx, order);
+        idx += 1 << order;
+        npages -= 1 << order;
+    }
+}
+
+/*
+ * Take NPAGES contiguous frames off the free lists. Returns the first
+ * frame index, or 0 if no free block is large enough. The frames are
+ * left in the free state for the caller to claim.
+ */
+static unsigned int frame_alloc(unsigned int npages) {
+    unsigned int order = 0;
+    while ((1u << order) < npages) {
+        order++;
+    }
+
+    unsigned int found = order;
+    while (found <= FRAME_MAX_ORDER && free_lists[found] == 0) {
+        found++;
+    }
+    if (found > FRAME_MAX_ORDER) {
+        return 0;
+    }
+
+    unsigned int idx = free_lists[found];
+    freelist_remove(idx, found);
+
+    // Split down to the size we need, keeping the lower half each time
+    while (found > order) {
+        found--;
+        freelist_push(idx + (1 << found), found);
+    }
+
+    // Give back the unused tail of a non-power-of-two request
+    if (npages < (1u << order)) {
+        frame_free_range(idx + npages, (1 << order) - npages);
+    }
+
+    return idx;
+}
+
+static unsigned int cached_frame_count(void);
+
+/*
+ * Frames nobody is using: those on the free lists, and those sitting
+ * in the per-CPU caches and the zero pool, which count as allocated
+ * but are just as free for the purposes of the pageout watermarks.
+ */
+static unsigned int free_frame_count(void) {
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    return (end_frame - first_frame) - allocated_pages_count + cached_frame_count();
+}
+
+/*
+ * Wake the pageout daemon if free memory has dropped below the low
+ * watermark. Called with coremap_lock held after allocating.
+ */
+static void pageout_check(void) {
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    if (pageout_wchan != NULL && !pageout_active && free_frame_count() < pageout_low) {
+        pageout_active = true;
+        wchan_wakeone(pageout_wchan, &coremap_lock);
+    }
+}
+
+/*
+ * Per-CPU caches of free frames, so that most single-frame allocations
+ * and frees do not touch coremap_lock or the free lists. A cache that
+ * runs dry is refilled with FRAME_CACHE_BATCH frames in one trip to the
+ * allocator, and a full one gives back the same number.
+ *
+ * Cached frames are marked fixed, so the free lists and the clock
+ * sweep both leave them alone, and a CPU can claim one from its cache
+ * without taking coremap_lock. They count as allocated in
+ * allocated_pages_count; coremap_memory_usage() subtracts them back
+ * out. Lock order: a cache's fc_lock, then coremap_lock.
+ *
+ * Early in boot, before thread_bootstrap(), there is no curcpu and so
+ * no cache to use: frames come from and go straight back to the free
+ * lists.
+ */
+#define FRAME_CACHE_SIZE  32
+#define FRAME_CACHE_BATCH 16
+
+struct frame_cache {
+    struct spinlock fc_lock;
+    unsigned int fc_count;
+    unsigned int fc_frames[FRAME_CACHE_SIZE];
+};
+
+static struct frame_cache frame_caches[MAXCPUS];
+
+/*
+ * Take a free frame from this CPU's cache, refilling it if necessary.
+ * Returns a frame index, or 0 if the global pool is empty as well.
+ */
+static unsigned int frame_cache_get(void) {
+    if (!CURCPU_EXISTS()) {
+        return 0; // The caller falls back to frame_alloc()
+    }
+
+    struct frame_cache *fc = &frame_caches[curcpu->c_number];
+    unsigned int frame = 0;
+
+    spinlock_acquire(&fc->fc_lock);
+    if (fc->fc_count == 0) {
+        spinlock_acquire(&coremap_lock);
+        while (fc->fc_count < FRAME_CACHE_BATCH) {
+            unsigned int refill = frame_alloc(1);
+            if (refill == 0) {
+                break;
+            }
+            coremap[refill].state = fixed;
+            fc->fc_frames[fc->fc_count++] = refill;
+        }
+        allocated_pages_count += fc->fc_count;
+        pageout_check();
+        spinlock_release(&coremap_lock);
+    }
+    if (fc->fc_count > 0) {
+        frame = fc->fc_frames[--fc->fc_count];
+    }
+    spinlock_release(&fc->fc_lock);
+
+    return frame;
+}
+
+/*
+ * Memory is short and our own cache is empty: take a frame from any
+ * other CPU's cache before resorting to eviction.
+ */
+static unsigned int frame_cache_steal(void) {
+    unsigned int frame = 0;
+
+    for (unsigned int i = 0; i < MAXCPUS && frame == 0; i++) {
+        struct frame_cache *fc = &frame_caches[i];
+
+        spinlock_acquire(&fc->fc_lock);
+        if (fc->fc_count > 0) {
+            frame = fc->fc_frames[--fc->fc_count];
+        }
+        spinlock_release(&fc->fc_lock);
+    }
+
+    return frame;
+}
+
+/*
+ * Put a frame, already marked fixed, in this CPU's cache, draining a
+ * batch back to the free lists if the cache is full.
+ */
+static void frame_cache_put(unsigned int frame) {
+    if (!CURCPU_EXISTS()) {
+        spinlock_acquire(&coremap_lock);
+        frame_free_range(frame, 1);
+        allocated_pages_count--;
+        spinlock_release(&coremap_lock);
+        return;
+    }
+
+    struct frame_cache *fc = &frame_caches[curcpu->c_number];
+
+    spinlock_acquire(&fc->fc_lock);
+    if (fc->fc_count == FRAME_CACHE_SIZE) {
+        spinlock_acquire(&coremap_lock);
+        for (unsigned int i = 0; i < FRAME_CACHE_BATCH; i++) {
+            frame_free_range(fc->fc_frames[--fc->fc_count], 1);
+        }
+        allocated_pages_count -= FRAME_CACHE_BATCH;
+        spinlock_release(&coremap_lock);
+    }
+    fc->fc_frames[fc->fc_count++] = frame;
+    spinlock_release(&fc->fc_lock);
+}
+
 static void as_zero_region(paddr_t paddr, unsigned npages) {
     bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
+/*
+ * Frames zeroed ahead of time by idle CPUs (see vm_idle_zero), so that
+ * single-frame allocations can skip the bzero. Like cached frames they
+ * are marked fixed and count as allocated. The pool is only topped up
+ * while free memory is above the pageout daemon's high watermark, so
+ * it never pushes the system into reclaim; allocations under memory
+ * pressure drain it like any other free frames. zero_pool_lock is a
+ * leaf: nothing else is acquired while holding it.
+ */
+#define ZERO_POOL_SIZE 64
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static unsigned int zero_pool[ZERO_POOL_SIZE];
+static unsigned int zero_pool_count;
+
+/*
+ * Frames counted in allocated_pages_count that are really free, in the
+ * frame caches or the zero pool. Called with coremap_lock held, which
+ * comes after the caches' locks, so the counts are read unlocked:
+ * batches only move between the caches and the free lists under
+ * coremap_lock, and single frames moving in and out of a cache or the
+ * pool leave the total at most a few frames off, which is fine for
+ * watermarks and statistics. A pre-zeroed frame is counted a moment
+ * before it joins the pool.
+ */
+static unsigned int cached_frame_count(void) {
+    unsigned int cached = 0;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    for (unsigned int i = 0; i < MAXCPUS; i++) {
+        cached += frame_caches[i].fc_count;
+    }
+    return cached + zero_pool_count;
+}
+
+/*
+ * Take a pre-zeroed frame, or return 0 if there is none. Allocations
+ * before thread_bootstrap() have no curcpu to count hits and misses
+ * against, and come before any idle loop could have filled the pool.
+ */
+static unsigned int zero_pool_get(void) {
+    unsigned int frame = 0;
+
+    if (!CURCPU_EXISTS()) {
+        return 0;
+    }
+
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_count > 0) {
+        frame = zero_pool[--zero_pool_count];
+    }
+    spinlock_release(&zero_pool_lock);
+
+    if (frame != 0) {
+        VMSTAT_INC(zero_pool_hits);
+    } else {
+        VMSTAT_INC(zero_pool_misses);
+    }
+    return frame;
+}
+
+/*
+ * Called from the idle loop, with interrupts off and no spinlocks
+ * held: zero one free frame into the pool, if it has room and memory
+ * is plentiful. Returns true if it did, so the caller should look for
+ * runnable threads again before calling us back, or false if there is
+ * nothing to do and the CPU may as well sleep.
+ *
+ * Interrupts are let in while the frame is zeroed. That is safe here
+ * because thread_yield does nothing on an idle CPU, and it keeps the
+ * 4K of stores from delaying interrupts.
+ */
+bool vm_idle_zero(void) {
+    spinlock_acquire(&zero_pool_lock);
+    bool full = zero_pool_count == ZERO_POOL_SIZE;
+    spinlock_release(&zero_pool_lock);
+    if (full) {
+        return false;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    unsigned int frame = 0;
+    if (free_frame_count() > pageout_high) {
+        frame = frame_alloc(1);
+    }
+    if (frame == 0) {
+        spinlock_release(&coremap_lock);
+        return false;
+    }
+    coremap[frame].state = fixed;
+    coremap[frame].chunk_size = 0;
+    allocated_pages_count++;
+    spinlock_release(&coremap_lock);
+
+    int spl = spl0();
+    as_zero_region(frame * PAGE_SIZE, 1);
+    splx(spl);
+
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_count < ZERO_POOL_SIZE) {
+        zero_pool[zero_pool_count++] = frame;
+        frame = 0;
+    }
+    spinlock_release(&zero_pool_lock);
+
+    if (frame != 0) {
+        frame_cache_put(frame); // Another idle CPU filled the last slot
+    } else {
+        VMSTAT_INC(zero_pool_fills);
+    }
+    return true;
+}
+
 void coremap_bootstrap(void) {
     // Retrieve memory boundaries
     memory_end = ram_getsize();
@@ -55,16 +506,32 @@ void coremap_bootstrap(void) {
     // Determine the number of pages already used
     unsigned int used_pages = memory_start / PAGE_SIZE;
 
-    // Loop through the entire coremap and initialize each page's metadata
-    for (unsigned int page_index = 0; page_index < total_pages; page_index++) {
-        coremap[page_index].chunk_size = 0;
+    // Mark the pages holding the kernel and the coremap as "fixed"
+    for (unsigned int page_index = 0; page_index < used_pages; page_index++) {
+        coremap[page_index] = (struct coremap_page){ .state = fixed, .chunk_size = 0 };
+    }
 
-        // Mark pages as either "fixed" (used) or "free"
-        if (page_index < used_pages) {
-            coremap[page_index].state = fixed;
-        } else {
-            coremap[page_index].state = free;
-        }
+    // Hand everything else to the frame allocator
+    first_frame = used_pages;
+    end_frame = total_pages;
+    for (unsigned int order = 0; order <= FRAME_MAX_ORDER; order++) {
+        free_lists[order] = 0;
+    }
+    frame_free_range(first_frame, end_frame - first_frame);
+
+    for (unsigned int i = 0; i < MAXCPUS; i++) {
+        asid_next[i] = 1;
+        asid_generation[i] = 1; // Address spaces start out in generation 0
+        asid_current[i] = 0;
+    }
+
+    // Default watermarks: start paging out at 1/32 of memory free
+    pageout_low = (end_frame - first_frame) / 32;
+    pageout_high = pageout_low * 2;
+
+    for (unsigned int i = 0; i < MAXCPUS; i++) {
+        spinlock_init(&frame_caches[i].fc_lock);
+        frame_caches[i].fc_count = 0;
     }
 
     // Set the eviction pointer to the first free page
@@ -74,11 +541,76 @@ void coremap_bootstrap(void) {
     allocated_pages_count = 0;
 }
 
+/*
+ * The pageout daemon. Reclaimed frames go straight back on the free
+ * lists for whoever needs them next.
+ */
+static void pageout_thread(void *unused1, unsigned long unused2) {
+    (void)unused1;
+    (void)unused2;
+
+    spinlock_acquire(&coremap_lock);
+    for (;;) {
+        pageout_active = false;
+        wchan_sleep(pageout_wchan, &coremap_lock);
+
+        while (free_frame_count() < pageout_high) {
+            paddr_t reclaimed = evict_page();
+            if (reclaimed == 0) {
+                break; // Nothing evictable right now; wait to be woken again
+            }
+            frame_free_range(reclaimed / PAGE_SIZE, 1);
+            allocated_pages_count--;
+            VMSTAT_INC(background_reclaims);
+        }
+    }
+}
+
+/*
+ * Set the pageout daemon's watermarks, in pages. A low watermark of 0
+ * turns background reclaim off.
+ */
+int vm_set_watermarks(unsigned int low, unsigned int high) {
+    spinlock_acquire(&coremap_lock);
+    if (low > high || high > end_frame - first_frame) {
+        spinlock_release(&coremap_lock);
+        return EINVAL;
+    }
+    pageout_low = low;
+    pageout_high = high;
+    pageout_check();
+    spinlock_release(&coremap_lock);
+    return 0;
+}
+
+void vm_get_watermarks(unsigned int *low, unsigned int *high, unsigned int *free_pages) {
+    spinlock_acquire(&coremap_lock);
+    *low = pageout_low;
+    *high = pageout_high;
+    *free_pages = free_frame_count();
+    spinlock_release(&coremap_lock);
+}
+
 void vm_bootstrap(void) {
     struct vnode *disk_node = NULL;
     struct stat disk_info;
     char disk_path[] = "lhd0raw:";
 
+    pte_lock_bootstrap();
+    pagecache_bootstrap();
+
+    vaddr_t zero_kvaddr = alloc_kpages(1); // Comes zeroed
+    if (zero_kvaddr == 0) {
+        panic("vm_bootstrap: Out of memory allocating the zero page\n");
+    }
+    zero_page = zero_kvaddr - MIPS_KSEG0;
+
+    eviction_wchan = wchan_create("eviction");
+    if (eviction_wchan == NULL) {
+        panic("vm_bootstrap: Out of memory creating eviction wchan\n");
+    }
+    vm_resetstats();
+
     // Open swap disk and validate
     if (vfs_open(disk_path, O_RDWR, 0, &disk_node)) {
         swap.vnode = NULL;
@@ -107,80 +639,148 @@ void vm_bootstrap(void) {
 
     // Swap structure setup
     swap.vnode = disk_node;
+    swap.slots = disk_info.st_size / PAGE_SIZE;
     swap.swap_disk_present = true;
+    zswap_bootstrap((memory_end - memory_start) / PAGE_SIZE);
+
+    // Paging out is only possible with a swap disk
+    pageout_wchan = wchan_create("pageout");
+    if (pageout_wchan == NULL) {
+        panic("vm_bootstrap: Out of memory creating pageout wchan\n");
+    }
+    pageout_active = true; // Until the daemon first goes to sleep
+    if (thread_fork("pageout", NULL, pageout_thread, NULL, 0)) {
+        panic("vm_bootstrap: Could not start the pageout daemon\n");
+    }
 }
 
 static paddr_t allocate_kernel_pages(unsigned long npages) {
-    paddr_t allocated_addr = 0;
-
-    spinlock_acquire(&coremap_lock);
-
-    unsigned int start_idx = memory_start / PAGE_SIZE;
-    unsigned int end_idx = memory_end / PAGE_SIZE;
-    unsigned int contiguous_free_pages = 0;
+    unsigned int first = 0;
+    bool zeroed = false;
 
-    // Search for a contiguous block of free pages
-    for (unsigned int i = start_idx; i < end_idx; i++) {
-        if (coremap[i].state == free) {
-            contiguous_free_pages++;
-            if (contiguous_free_pages == npages) {
-                allocated_addr = (i - npages + 1) * PAGE_SIZE;
-                break;
-            }
+    if (npages == 1) {
+        first = zero_pool_get();
+        if (first != 0) {
+            zeroed = true;
         } else {
-            contiguous_free_pages = 0;
+            first = frame_cache_get();
+        }
+        if (first == 0) {
+            first = frame_cache_steal();
+        }
+        if (first != 0) {
+            // Cached frames are already fixed; nobody else looks at them
+            coremap[first].chunk_size = 1;
         }
     }
 
-    if (!allocated_addr) {
+    if (first == 0) {
+        spinlock_acquire(&coremap_lock);
+
+        first = frame_alloc(npages);
+        if (first == 0) {
+            spinlock_release(&coremap_lock);
+            return 0; // No available block
+        }
+
+        // Update metadata for the allocated block
+        for (unsigned int i = 0; i < npages; i++) {
+            coremap[first + i].state = fixed;
+            coremap[first + i].chunk_size = (i == 0) ? npages : 0;
+        }
+
+        allocated_pages_count += npages;
+        pageout_check();
         spinlock_release(&coremap_lock);
-        return 0; // No available block
     }
 
-    // Update metadata for the allocated block
-    for (unsigned int i = 0; i < npages; i++) {
-        coremap[(allocated_addr / PAGE_SIZE) + i].state = fixed;
-        coremap[(allocated_addr / PAGE_SIZE) + i].chunk_size = (i == 0) ? npages : 0;
+    // The frames are ours now; no need to zero them under the lock
+    paddr_t allocated_addr = first * PAGE_SIZE;
+    if (!zeroed) {
+        as_zero_region(allocated_addr, npages);
     }
-
-    allocated_pages_count += npages;
-    as_zero_region(allocated_addr, npages);
-
-    spinlock_release(&coremap_lock);
     return allocated_addr;
 }
 
-paddr_t allocate_user_page(unsigned long pages, struct addrspace *as, vaddr_t vpage_addr, bool copy_call) {
+/*
+ * Hand the frame at PADDR to PTE as a user page.
+ *
+ * The clock sweep reads the coremap under coremap_lock, which we may
+ * not hold here. It ignores frames that are not "used", so fill in the
+ * owner first and publish the state last.
+ */
+static void claim_user_frame(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+                             struct page_table_entry *pte, bool referenced) {
+    struct coremap_page *page = &coremap[paddr / PAGE_SIZE];
+    page->owner_addrspace = as;
+    page->owner_vaddr = vaddr;
+    page->owner_pte = pte;
+    page->ref_bit = referenced;
+    page->age = 0;
+    page->chunk_size = 0;
+    membar_store_store();
+    page->state = used;
+}
+
+paddr_t allocate_user_page(unsigned long pages, struct addrspace *as, vaddr_t vpage_addr,
+                           struct page_table_entry *pte, bool copy_call) {
     KASSERT(pages == 1); // Single-page allocations only
+    KASSERT(pte != NULL);
 
     paddr_t allocated_addr = 0;
+    bool locked = false;
+    bool zeroed = false;
 
-    spinlock_acquire(&coremap_lock);
+    unsigned int frame = zero_pool_get();
+    if (frame != 0) {
+        zeroed = true;
+    } else {
+        frame = frame_cache_get();
+    }
+    if (frame == 0) {
+        frame = frame_cache_steal();
+    }
 
-    // Search for a free page
-    for (unsigned int i = memory_start / PAGE_SIZE; i < memory_end / PAGE_SIZE; i++) {
-        if (coremap[i].state == free) {
-            allocated_addr = i * PAGE_SIZE;
-            coremap[i] = (struct coremap_page){
-                .state = used,
-                .owner_addrspace = as,
-                .owner_vaddr = vpage_addr,
-                .ref_bit = !copy_call,
-                .chunk_size = 1
-            };
-            break;
+    if (frame != 0) {
+        allocated_addr = frame * PAGE_SIZE;
+    } else {
+        spinlock_acquire(&coremap_lock);
+        locked = true;
+
+        // Somebody may have drained a cache since we looked
+        frame = frame_alloc(1);
+        if (frame != 0) {
+            allocated_addr = frame * PAGE_SIZE;
+            allocated_pages_count++;
+            pageout_check();
+        } else if (swap.swap_disk_present) {
+            // Out of free frames: reclaim one from some address space instead
+            allocated_addr = evict_page();
+            if (allocated_addr) {
+                VMSTAT_INC(direct_reclaims);
+            }
+        }
+
+        if (!allocated_addr) {
+            spinlock_release(&coremap_lock);
+            VMSTAT_INC(eviction_failures);
+            return 0; // No available pages
         }
     }
 
-    if (!allocated_addr) {
+    claim_user_frame(allocated_addr, as, vpage_addr, pte, !copy_call);
+
+    if (locked) {
         spinlock_release(&coremap_lock);
-        return 0; // No available pages
     }
 
-    allocated_pages_count++;
-    as_zero_region(allocated_addr, pages);
-
-    spinlock_release(&coremap_lock);
+    /*
+     * Zeroing outside the lock is safe: the caller holds PTE's lock,
+     * so an evictor that picks this frame right away will wait for us.
+     */
+    if (!zeroed) {
+        as_zero_region(allocated_addr, pages);
+    }
     return allocated_addr;
 }
 
@@ -192,229 +792,1093 @@ vaddr_t alloc_kpages(unsigned npages) {
 void free_kpages(vaddr_t addr) {
     paddr_t physical_addr = addr - MIPS_KSEG0;
 
-    spinlock_acquire(&coremap_lock);
-
     KASSERT(physical_addr % PAGE_SIZE == 0);
 
     unsigned int start_index = physical_addr / PAGE_SIZE;
     unsigned int chunk_size = coremap[start_index].chunk_size;
+    KASSERT(coremap[start_index].state == fixed && chunk_size > 0);
 
-    for (unsigned int i = 0; i < chunk_size; i++) {
-        coremap[start_index + i] = (struct coremap_page){ .state = free, .chunk_size = 0 };
+    // Kernel frames are never evicted, so a single one needs no coremap_lock
+    if (chunk_size == 1) {
+        coremap[start_index].chunk_size = 0;
+        frame_cache_put(start_index);
+        return;
     }
 
+    spinlock_acquire(&coremap_lock);
+    frame_free_range(start_index, chunk_size);
     allocated_pages_count -= chunk_size;
     spinlock_release(&coremap_lock);
 }
 
+/*
+ * Free a user frame. Returns 1, leaving the frame alone, if it is in
+ * the middle of being evicted.
+ */
 int release_physical_page(paddr_t page_paddr) {
-    spinlock_acquire(&coremap_lock);
-
     KASSERT(page_paddr % PAGE_SIZE == 0);
 
     unsigned int page_idx = page_paddr / PAGE_SIZE;
 
+    // The evictor claims frames under coremap_lock, so we must check under it too
+    spinlock_acquire(&coremap_lock);
     if (coremap[page_idx].state == in_eviction) {
         spinlock_release(&coremap_lock);
         return 1;
     }
-
-    coremap[page_idx] = (struct coremap_page){ .state = free, .chunk_size = 0, .owner_addrspace = NULL, .owner_vaddr = 0 };
-
-    allocated_pages_count--;
+    coremap[page_idx] = (struct coremap_page){ .state = fixed, .chunk_size = 0 };
     spinlock_release(&coremap_lock);
 
+    frame_cache_put(page_idx);
     return 0;
 }
 
+/*
+ * Sleep until the eviction of the frame at PAGE_PADDR on behalf of PTE
+ * has finished. The caller must not hold PTE's lock, since the evictor
+ * needs it to mark the page swapped.
+ */
+static void wait_for_eviction(paddr_t page_paddr, struct page_table_entry *pte) {
+    unsigned int page_idx = page_paddr / PAGE_SIZE;
 
-void tlb_invalidate_entry(vaddr_t remove_vaddr) {
-    int old_spl = splhigh();
-    int tlb_index = tlb_probe(remove_vaddr, 0);
-    if (tlb_index >= 0) {
-        tlb_write(TLBHI_INVALID(tlb_index), TLBLO_INVALID(), tlb_index);
+    spinlock_acquire(&coremap_lock);
+    while (coremap[page_idx].state == in_eviction && coremap[page_idx].owner_pte == pte) {
+        wchan_sleep(eviction_wchan, &coremap_lock);
     }
-    splx(old_spl);
+    spinlock_release(&coremap_lock);
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress) {
-    (void)faulttype;
-
-    struct addrspace *as = proc_getas();
-    if (as == NULL) {
-        return EFAULT; // No address space
-    }
-
-    faultaddress &= PAGE_FRAME; // Align faultaddress to page boundary
-    vaddr_t stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
-    vaddr_t stacktop = USERSTACK;
-    bool valid_address = false;
+/*
+ * Is PTE's frame on its way out to swap? The evictor does not hold the
+ * PTE's lock while it writes the page, so a faulter that finds the page
+ * MAPPED must check this before using it. Called with PTE's lock held.
+ *
+ * Reading the state without coremap_lock is safe: if an evictor claims
+ * the frame just after we look, it will wait for the PTE lock and then
+ * invalidate whatever mapping we install.
+ */
+static bool frame_in_eviction(struct page_table_entry *pte) {
+    KASSERT(pte_locked(pte));
+    KASSERT(pte->state == MAPPED);
+    return coremap[pte->ppn].state == in_eviction;
+}
 
-    // Validate the fault address
-    if ((faultaddress >= stackbase && faultaddress < stacktop) || 
-        (faultaddress >= as->heap_start && faultaddress < as->heap_end)) {
-        valid_address = true;
-    } else {
-        for (struct region *region = as->start_region; region != NULL; region = region->next) {
-            if (faultaddress >= region->start && faultaddress < region->start + region->size) {
-                valid_address = true;
-                break;
+/*
+ * Give back whatever backs PTE: its physical frame or its swap slot.
+ * Called with PTE's lock held; returns with it held and the PTE
+ * UNMAPPED. If the frame is in the middle of being evicted we wait for
+ * the evictor to finish and free the swap slot it wrote instead, so the
+ * evictor never touches a PTE that has already been freed.
+ *
+ * TLB entries are the caller's business: the last holder of a PTE is
+ * the address space releasing it, which is either dead or running right
+ * here, and as_unmap_range drops its translations before letting go of
+ * the frames behind them.
+ */
+void release_pte_backing(struct page_table_entry *pte) {
+    KASSERT(pte_locked(pte));
+
+    while (pte->state == MAPPED) {
+        paddr_t ppage = PTE_PADDR(pte);
+
+        if (release_physical_page(ppage) == 0) {
+            if (!pte->dirty) {
+                unmark_swap_bitmap(pte->diskpage_location);
             }
+            pte->state = UNMAPPED;
+            return;
         }
-    }
 
-    if (!valid_address) {
-        return EFAULT; // Invalid address
+        pte_unlock(pte);
+        wait_for_eviction(ppage, pte);
+        pte_lock(pte);
     }
 
-    struct page_table_entry *pte = as->start_page_table;
-    struct page_table_entry *prev_pte = NULL;
-    paddr_t physical_page = 0;
+    if (pte->state == SWAPPED) {
+        unmark_swap_bitmap(pte->diskpage_location);
+        pte->state = UNMAPPED;
+    }
+}
 
-    // Search for the page table entry corresponding to faultaddress
-    while (pte != NULL) {
-        if (pte->as_vpage == faultaddress) {
-            lock_acquire(pte->lock);
-
-            if (pte->state == SWAPPED) { // Handle swapped page
-                physical_page = allocate_user_page(1, as, faultaddress, false);
-                if (!physical_page) {
-                    lock_release(pte->lock);
-                    return ENOMEM; // Allocation failed
-                }
-                if (read_swap_disk(physical_page, pte->diskpage_location, true)) {
-                    panic("Swap read failed");
-                }
-                pte->as_ppage = physical_page;
-                pte->state = MAPPED;
-            } else if (pte->state == MAPPED) { // Already mapped
-                physical_page = pte->as_ppage;
-            }
+/*
+ * release_pte_backing for the N PTES at once, with one pass under
+ * coremap_lock and one under swap_lock instead of a pair per page. The
+ * PTEs have lost their last reference and are in no page table, and
+ * the caller has already taken the cached ones out of the page cache,
+ * so only an evictor that already has one of the frames can still
+ * reach them. That is why their fields may be changed without the PTE
+ * locks: claiming the frames under coremap_lock settles which ones the
+ * evictor has, and those are left to release_pte_backing, which takes
+ * the lock and waits for it.
+ */
+void release_pte_backing_batch(struct page_table_entry **ptes, unsigned int n) {
+    bool evicting[PTE_BATCH];
+    unsigned int slots[PTE_BATCH];
+    unsigned int nslots = 0;
+
+    KASSERT(n <= PTE_BATCH);
 
-            lock_release(pte->lock);
-            break;
+    spinlock_acquire(&coremap_lock);
+    for (unsigned int i = 0; i < n; i++) {
+        KASSERT(ptes[i]->refcount == 0);
+        evicting[i] = false;
+        if (ptes[i]->state != MAPPED) {
+            continue;
         }
-
-        prev_pte = pte;
-        pte = pte->next;
+        if (coremap[ptes[i]->ppn].state == in_eviction) {
+            evicting[i] = true;
+            continue;
+        }
+        coremap[ptes[i]->ppn] = (struct coremap_page){ .state = fixed, .chunk_size = 0 };
     }
+    spinlock_release(&coremap_lock);
 
-    // If no existing PTE, create a new one
-    if (!pte) {
-        pte = kmalloc(sizeof(*pte));
-        if (!pte) {
-            return ENOMEM; // Memory allocation failed
+    for (unsigned int i = 0; i < n; i++) {
+        struct page_table_entry *pte = ptes[i];
+        if (evicting[i]) {
+            continue;
         }
-
-        pte->lock = lock_create("pte_lock");
-        if (!pte->lock) {
-            kfree(pte);
-            return ENOMEM;
+        if (pte->state == MAPPED) {
+            frame_cache_put(pte->ppn);
+            if (!pte->dirty) {
+                slots[nslots++] = pte->diskpage_location;
+            }
+        } else if (pte->state == SWAPPED) {
+            slots[nslots++] = pte->diskpage_location;
         }
-
-        lock_acquire(pte->lock);
-        pte->as_vpage = faultaddress;
         pte->state = UNMAPPED;
-        pte->next = NULL;
+    }
 
-        if (prev_pte) {
-            prev_pte->next = pte;
-        } else {
-            as->start_page_table = pte;
+    if (nslots > 0) {
+        // As in unmark_swap_bitmap: no slot may be reused before its
+        // zswap entry is gone
+        for (unsigned int i = 0; i < nslots; i++) {
+            zswap_invalidate(slots[i]);
         }
-
-        physical_page = allocate_user_page(1, as, faultaddress, false);
-        if (!physical_page) {
-            lock_release(pte->lock);
-            lock_destroy(pte->lock);
-            kfree(pte);
-            return ENOMEM;
+        spinlock_acquire(&swap_lock);
+        for (unsigned int i = 0; i < nslots; i++) {
+            if (bitmap_isset(swap.bitmap, slots[i])) {
+                bitmap_unmark(swap.bitmap, slots[i]);
+            }
         }
-
-        pte->as_ppage = physical_page;
-        pte->state = MAPPED;
-        lock_release(pte->lock);
+        spinlock_release(&swap_lock);
     }
 
-    // Insert the mapping into the TLB
-    int spl = splhigh();
-    for (int i = 0; i < NUM_TLB; i++) {
-        uint32_t ehi, elo;
-        tlb_read(&ehi, &elo, i);
-
-        if (elo & TLBLO_VALID) {
-            continue; // Skip valid entries
+    for (unsigned int i = 0; i < n; i++) {
+        if (evicting[i]) {
+            pte_lock(ptes[i]);
+            release_pte_backing(ptes[i]);
+            pte_unlock(ptes[i]);
         }
+    }
+}
 
-        tlb_write(faultaddress, physical_page | TLBLO_DIRTY | TLBLO_VALID, i);
-        splx(spl);
-
-        coremap[physical_page / PAGE_SIZE].ref_bit = true;
+/*
+ * Write LEN bytes of the page behind PTE, resident or swapped out, to
+ * V at OFFSET, if it has been written since it was last written back.
+ * The page is copied out under PTE's lock and written from the copy:
+ * the write may need memory, which we may not allocate holding the
+ * lock of a PTE with a frame.
+ *
+ * Every address space sharing the PTE writes it back when it unmaps
+ * it, so the page is marked clean and made read-only everywhere before
+ * it is copied. A write made after that faults and marks it dirty
+ * again; otherwise the later sharers skip it instead of writing their
+ * stale copy over newer changes to the file.
+ */
+int vm_writeback_page(struct page_table_entry *pte, struct vnode *v, off_t offset, size_t len) {
+    KASSERT(len <= PAGE_SIZE);
+
+    pte_lock(pte);
+    bool file_dirty = pte->file_dirty;
+    pte_unlock(pte);
+    if (!file_dirty) {
         return 0;
     }
 
-    // If no free slot is available, use a random TLB entry
-    tlb_random(faultaddress, physical_page | TLBLO_DIRTY | TLBLO_VALID);
-    splx(spl);
-
-    coremap[physical_page / PAGE_SIZE].ref_bit = true;
+    vaddr_t kvaddr = alloc_kpages(1);
+    if (kvaddr == 0) {
+        return ENOMEM;
+    }
 
-    return 0;
+    pte_lock(pte);
+    while (pte->state == MAPPED && frame_in_eviction(pte)) {
+        paddr_t evicting = PTE_PADDR(pte);
+        pte_unlock(pte);
+        wait_for_eviction(evicting, pte);
+        pte_lock(pte);
+    }
+    pte->file_dirty = false;
+    if (pte->state == MAPPED) {
+        // Faulters need the PTE lock to map it writable again
+        paddr_t frame = PTE_PADDR(pte);
+        if (pte->tlb_cpus != 0) {
+            tlb_shootdown_frames(&frame, 1, pte->tlb_cpus);
+            pte->tlb_cpus = 0;
+        }
+        memmove((void *)kvaddr, (const void *)PADDR_TO_KVADDR(frame), len);
+    } else {
+        KASSERT(pte->state == SWAPPED);
+        if (read_swap_disk(kvaddr - MIPS_KSEG0, pte->diskpage_location, false)) {
+            panic("Swap read failed");
+        }
+    }
+    pte_unlock(pte);
+
+    struct iovec iov;
+    struct uio ku;
+    uio_kinit(&iov, &ku, (void *)kvaddr, len, offset, UIO_WRITE);
+    int result = VOP_WRITE(v, &ku);
+    free_kpages(kvaddr);
+    VMSTAT_INC(file_writebacks);
+    if (result) {
+        // Still not on disk; let whoever comes next try again
+        pte_lock(pte);
+        pte->file_dirty = true;
+        pte_unlock(pte);
+    }
+    return result;
 }
 
+/* EntryHi for VADDR in the current address space; call at splhigh */
+static uint32_t tlb_entryhi(vaddr_t vaddr) {
+    return (vaddr & TLBHI_VPAGE) | (asid_current[curcpu->c_number] << TLBHI_PIDSHIFT);
+}
 
-unsigned int coremap_memory_usage(void) {
-    return allocated_pages_count * PAGE_SIZE;
+/* Put back the current ASID after a TLB operation has clobbered it */
+static void tlb_restore_asid(void) {
+    tlb_setasid(asid_current[curcpu->c_number]);
 }
 
-int read_swap_disk(paddr_t page_paddr, unsigned int disk_index, bool unmark) {
-    // Ensure the bitmap entry for the disk index is set
-    if (!bitmap_isset(swap.bitmap, disk_index)) {
-        return EINVAL; // Invalid disk index
+void tlb_activate(struct addrspace *as) {
+    int spl = splhigh();
+    unsigned int cpu = curcpu->c_number;
+
+    if (as->asid_generation[cpu] != asid_generation[cpu]) {
+        if (asid_next[cpu] == NUM_ASID) {
+            // Out of ASIDs: start a new generation
+            asid_generation[cpu]++;
+            asid_next[cpu] = 1;
+            tlb_invalidate_all();
+            VMSTAT_INC(asid_rollovers);
+        }
+        as->asid[cpu] = asid_next[cpu]++;
+        as->asid_generation[cpu] = asid_generation[cpu];
+    }
+
+    asid_current[cpu] = as->asid[cpu];
+    tlb_restore_asid();
+    splx(spl);
+}
+
+/*
+ * Make everything AS has left in other CPUs' TLBs unreachable, without
+ * interrupting them: forget its ASIDs there, so it gets fresh ones if
+ * it ever runs there again. The old IDs are only handed out again
+ * after a full flush. Only for the current thread's address space,
+ * which cannot be running anywhere else, and which is the only thing
+ * that ever activates it; so nobody else writes these slots.
+ */
+void tlb_invalidate_as_elsewhere(struct addrspace *as) {
+    int spl = splhigh();
+    for (unsigned int cpu = 0; cpu < MAXCPUS; cpu++) {
+        if (cpu != curcpu->c_number) {
+            as->asid_generation[cpu] = 0;
+        }
+    }
+    splx(spl);
+}
+
+/* As above, and here too: move AS to a fresh ASID on this CPU */
+void tlb_invalidate_as(struct addrspace *as) {
+    int spl = splhigh();
+    tlb_invalidate_as_elsewhere(as);
+    as->asid_generation[curcpu->c_number] = 0;
+    tlb_activate(as);
+    splx(spl);
+}
+
+/*
+ * Drop the N frames in FRAMES from every TLB that may hold them: the
+ * CPUs in CPUMASK (see tlb_load_entry). Other CPUs get all N in one
+ * IPI, and we wait for them, so on return the frames can be written
+ * out or reused. Must not be called with spinlocks held.
+ */
+static void tlb_shootdown_frames(const paddr_t *frames, unsigned int n, uint32_t cpumask) {
+    struct tlbshootdown ts[SWAP_CLUSTER];
+    unsigned int sent;
+
+    KASSERT(n <= SWAP_CLUSTER);
+    for (unsigned int i = 0; i < n; i++) {
+        ts[i].ts_paddr = frames[i];
+    }
+    sent = ipi_tlbshootdown_sync(cpumask, ts, n);
+    VMSTAT_ADD(tlb_shootdowns, sent);
+}
+
+void tlb_invalidate_entry(vaddr_t remove_vaddr) {
+    int old_spl = splhigh();
+    int tlb_index = tlb_probe(tlb_entryhi(remove_vaddr), 0);
+    if (tlb_index >= 0) {
+        tlb_write(TLBHI_INVALID(tlb_index), TLBLO_INVALID(), tlb_index);
+    }
+    tlb_restore_asid();
+    splx(old_spl);
+}
+
+/*
+ * Drop this CPU's translations for [START, END) in the current address
+ * space. A short range is probed for page by page; past the size of
+ * the TLB it is cheaper to read every entry once and pick out the ones
+ * that fall inside.
+ */
+void tlb_invalidate_range(vaddr_t start, vaddr_t end) {
+    int spl = splhigh();
+
+    if ((end - start) / PAGE_SIZE <= NUM_TLB) {
+        for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+            int i = tlb_probe(tlb_entryhi(vaddr), 0);
+            if (i >= 0) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    } else {
+        uint32_t asid = asid_current[curcpu->c_number];
+        for (int i = 0; i < NUM_TLB; i++) {
+            uint32_t ehi, elo;
+            tlb_read(&ehi, &elo, i);
+            vaddr_t vaddr = ehi & TLBHI_VPAGE;
+            if ((elo & TLBLO_VALID) && ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT) == asid &&
+                vaddr >= start && vaddr < end) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+    }
+    tlb_restore_asid();
+    splx(spl);
+}
+
+/*
+ * Drop every translation to the frame at PADDR, whatever address space
+ * it belongs to.
+ */
+void tlb_invalidate_frame(paddr_t paddr) {
+    int spl = splhigh();
+    for (int i = 0; i < NUM_TLB; i++) {
+        uint32_t ehi, elo;
+        tlb_read(&ehi, &elo, i);
+        if ((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == paddr) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    tlb_restore_asid();
+    splx(spl);
+}
+
+void tlb_invalidate_all(void) {
+    int spl = splhigh();
+    for (int i = 0; i < NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_restore_asid();
+    splx(spl);
+    VMSTAT_INC(tlb_flushes);
+}
+
+/*
+ * Write the translation EHI -> ELO into the TLB. An existing entry for
+ * the page (e.g. the read-only one that caused a VM_FAULT_READONLY) is
+ * overwritten in place, since the TLB must never hold two entries for
+ * the same page. Call at splhigh.
+ */
+static void tlb_write_entry(uint32_t ehi, uint32_t elo) {
+    int index = tlb_probe(ehi, 0);
+    if (index < 0) {
+        // Prefer an invalid slot; tlb_read clobbers the ASID, hence the restore
+        for (int i = 0; i < NUM_TLB; i++) {
+            uint32_t old_ehi, old_elo;
+            tlb_read(&old_ehi, &old_elo, i);
+            if (!(old_elo & TLBLO_VALID)) {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    if (index >= 0) {
+        tlb_write(ehi, elo, index);
+    } else {
+        // If no free slot is available, use a random TLB entry
+        tlb_random(ehi, elo);
+    }
+    tlb_restore_asid();
+}
+
+/*
+ * Load PTE's translation into the TLB, writable or not, and note that
+ * this CPU now may hold it. Called with the PTE's lock held so that an
+ * evictor cannot slip in between us deciding the page is resident and
+ * the translation becoming visible.
+ */
+static void tlb_load_entry(struct page_table_entry *pte, bool writable) {
+    uint32_t elo = PTE_PADDR(pte) | TLBLO_VALID;
+    if (writable) {
+        elo |= TLBLO_DIRTY;
+    }
+
+    KASSERT(pte_locked(pte));
+
+    int spl = splhigh();
+    pte->tlb_cpus |= (uint32_t)1 << curcpu->c_number;
+    tlb_write_entry(tlb_entryhi(PTE_VADDR(pte)), elo);
+    splx(spl);
+}
+
+/*
+ * Read of an untouched anonymous page: map the zero page read-only.
+ * No PTE, no frame, no zeroing; see zero_page.
+ */
+static void vm_fault_zero_page(vaddr_t faultaddress) {
+    int spl = splhigh();
+    tlb_write_entry(tlb_entryhi(faultaddress), zero_page | TLBLO_VALID);
+    splx(spl);
+    VMSTAT_INC(zero_maps);
+}
+
+/*
+ * First write to an anonymous page, or first touch of one that is
+ * shared: give it a fresh zeroed frame.
+ */
+static int vm_fault_zero_fill(struct addrspace *as, vaddr_t faultaddress, bool writable) {
+    struct page_table_entry *pte = pte_create(faultaddress);
+    if (!pte) {
+        return ENOMEM; // Memory allocation failed
+    }
+
+    /*
+     * Install the PTE before allocating its frame: once the frame is
+     * handed out the evictor may pick it and will need to find (and
+     * wait on) this PTE.
+     */
+    pte_lock(pte);
+
+    if (pt_insert(as, faultaddress, pte)) {
+        pte_unlock(pte);
+        pte_destroy(pte);
+        return ENOMEM;
+    }
+
+    paddr_t physical_page = allocate_user_page(1, as, faultaddress, pte, false);
+    if (!physical_page) {
+        pt_remove(as, faultaddress);
+        pte_unlock(pte);
+        pte_destroy(pte);
+        return ENOMEM;
+    }
+    VMSTAT_INC(zero_fills);
+
+    // Never written to swap, so it has to be treated as dirty
+    pte->ppn = physical_page / PAGE_SIZE;
+    pte->state = MAPPED;
+    pte->dirty = true;
+
+    tlb_load_entry(pte, writable);
+    coremap[physical_page / PAGE_SIZE].ref_bit = true;
+    pte_unlock(pte);
+
+    return 0;
+}
+
+/*
+ * First touch of a page that comes (at least partly) from a file (the
+ * executable, or an mmapped one): read it in.
+ *
+ * The read goes into a kernel page, before any PTE exists: reading the
+ * file may itself need memory, and a thread holding the lock of a PTE
+ * with a frame must not allocate (it could end up evicting its own
+ * frame). The filled page then simply becomes the user page.
+ *
+ * If TEXT_VNODE is set the page is shareable text, and is entered in
+ * the page cache under TEXT_VNODE and TEXT_OFFSET once it is mapped.
+ */
+static int vm_fault_file(struct addrspace *as, vaddr_t faultaddress, bool writable,
+                         struct vnode *text_vnode, off_t text_offset) {
+    bool backed;
+
+    vaddr_t kvaddr = alloc_kpages(1); // Comes zeroed, which covers any BSS part
+    if (kvaddr == 0) {
+        return ENOMEM;
+    }
+
+    int result = as_read_file_page(as, faultaddress, (void *)kvaddr, &backed);
+    if (result) {
+        free_kpages(kvaddr);
+        return result;
+    }
+
+    struct page_table_entry *pte = pte_create(faultaddress);
+    if (!pte) {
+        free_kpages(kvaddr);
+        return ENOMEM;
+    }
+
+    pte_lock(pte);
+    if (pt_insert(as, faultaddress, pte)) {
+        pte_unlock(pte);
+        pte_destroy(pte);
+        free_kpages(kvaddr);
+        return ENOMEM;
+    }
+
+    paddr_t physical_page = kvaddr - MIPS_KSEG0;
+    claim_user_frame(physical_page, as, faultaddress, pte, true);
+    VMSTAT_INC(file_fills);
+
+    // Like a zero-filled page, it has no copy in swap yet
+    pte->ppn = physical_page / PAGE_SIZE;
+    pte->state = MAPPED;
+    pte->dirty = true;
+    pte->cached = text_vnode != NULL;
+
+    tlb_load_entry(pte, writable && !pte->cached);
+    pte_unlock(pte);
+
+    if (text_vnode != NULL && pagecache_insert(text_vnode, text_offset, pte)) {
+        // Lost a race with another process, or out of memory: keep it private
+        pte_lock(pte);
+        pte->cached = false;
+        pte_unlock(pte);
+    }
+
+    return 0;
+}
+
+/*
+ * First touch of a page that has no PTE yet; WRITABLE says whether it
+ * may be mapped writable right away, and ZERO_OK whether, if it turns
+ * out to be anonymous memory, it may be read from the zero page.
+ * Returns EAGAIN if a PTE was found in the page cache and installed,
+ * to be mapped like any other existing page.
+ */
+static int vm_fault_new_page(struct addrspace *as, vaddr_t faultaddress, bool writable,
+                             bool zero_ok) {
+    struct vnode *text_vnode;
+    off_t text_offset;
+    bool backed;
+
+    if (as_text_page(as, faultaddress, &text_vnode, &text_offset)) {
+        struct page_table_entry *pte = pagecache_lookup(text_vnode, text_offset, faultaddress);
+        if (pte == NULL) {
+            return vm_fault_file(as, faultaddress, writable, text_vnode, text_offset);
+        }
+        if (pt_insert(as, faultaddress, pte)) {
+            pte_release(pte);
+            return ENOMEM;
+        }
+        VMSTAT_INC(text_shares);
+        return EAGAIN;
+    }
+
+    as_read_file_page(as, faultaddress, NULL, &backed);
+    if (backed) {
+        return vm_fault_file(as, faultaddress, writable, NULL, 0);
+    }
+    if (zero_ok) {
+        vm_fault_zero_page(faultaddress);
+        return 0;
+    }
+    return vm_fault_zero_fill(as, faultaddress, writable);
+}
+
+/*
+ * First touch of a page of a shared mapping whose PTE as_copy created
+ * empty, so that it could be shared before it had a frame: give PTE
+ * one, read from the file or zeroed. The file is read before PTE is
+ * locked, as in vm_fault_file. Returns EAGAIN for the caller to map
+ * the page like any other, also if another sharer filled it first.
+ */
+static int vm_fault_fill(struct addrspace *as, vaddr_t faultaddress,
+                         struct page_table_entry *pte) {
+    vaddr_t kvaddr = 0;
+    bool backed;
+
+    as_read_file_page(as, faultaddress, NULL, &backed);
+    if (backed) {
+        kvaddr = alloc_kpages(1); // Comes zeroed, which covers any part past EOF
+        if (kvaddr == 0) {
+            return ENOMEM;
+        }
+        int result = as_read_file_page(as, faultaddress, (void *)kvaddr, &backed);
+        if (result) {
+            free_kpages(kvaddr);
+            return result;
+        }
+    }
+
+    pte_lock(pte);
+    if (pte->state != UNMAPPED) {
+        pte_unlock(pte);
+        if (kvaddr != 0) {
+            free_kpages(kvaddr);
+        }
+        return EAGAIN;
+    }
+
+    paddr_t physical_page;
+    if (kvaddr != 0) {
+        physical_page = kvaddr - MIPS_KSEG0;
+        claim_user_frame(physical_page, as, faultaddress, pte, true);
+        VMSTAT_INC(file_fills);
+    } else {
+        // No frame yet, so we may allocate holding the lock
+        physical_page = allocate_user_page(1, as, faultaddress, pte, false);
+        if (!physical_page) {
+            pte_unlock(pte);
+            return ENOMEM;
+        }
+        VMSTAT_INC(zero_fills);
+    }
+
+    // Never written to swap, so it has to be treated as dirty
+    pte->ppn = physical_page / PAGE_SIZE;
+    pte->state = MAPPED;
+    pte->dirty = true;
+    pte_unlock(pte);
+
+    return EAGAIN;
+}
+
+/*
+ * Write to a page shared copy-on-write: give this address space its
+ * own copy of SHARED.
+ *
+ * The new frame is allocated before SHARED is locked, and the new
+ * PTE's lock is dropped again before taking SHARED's. Allocation may
+ * evict, and a faulter that holds SHARED while swapping it in may in
+ * turn be evicting our new frame, so holding either lock across the
+ * other's acquisition could deadlock. The lock order is therefore
+ * SHARED, then the private PTE. Returns EAGAIN if the caller should
+ * look at the page again: either the other sharers went away and the
+ * page can be made writable in place (unless it is cached text), or
+ * our new frame was evicted before we got to fill it.
+ */
+static int vm_fault_cow(struct addrspace *as, vaddr_t faultaddress,
+                        struct page_table_entry *shared) {
+    struct page_table_entry *pte = pte_create(faultaddress);
+    if (!pte) {
+        return ENOMEM;
+    }
+
+    pte_lock(pte);
+    paddr_t physical_page = allocate_user_page(1, as, faultaddress, pte, false);
+    if (!physical_page) {
+        pte_unlock(pte);
+        pte_destroy(pte);
+        return ENOMEM;
+    }
+    pte->ppn = physical_page / PAGE_SIZE;
+    pte->state = MAPPED;
+    pte->dirty = true;
+    pte_unlock(pte);
+
+    pte_lock(shared);
+    pte_lock(pte);
+
+    if ((shared->refcount == 1 && !shared->cached) ||
+        pte->state != MAPPED || frame_in_eviction(pte)) {
+        pte_unlock(shared);
+        release_pte_backing(pte);
+        pte_unlock(pte);
+        pte_destroy(pte);
+        return EAGAIN;
+    }
+
+    if (shared->state == SWAPPED) {
+        if (read_swap_disk(physical_page, shared->diskpage_location, false)) {
+            panic("Swap read failed");
+        }
+        VMSTAT_INC(swap_ins);
+    } else {
+        KASSERT(shared->state == MAPPED);
+        memmove((void *)PADDR_TO_KVADDR(physical_page),
+                (const void *)PADDR_TO_KVADDR(PTE_PADDR(shared)), PAGE_SIZE);
+    }
+    // The last mapper of a cached page drops it once its own lock is released
+    bool last = shared->refcount == 1;
+    if (!last) {
+        shared->refcount--;
+    }
+    pte_unlock(shared);
+
+    // Swap our private copy in for the shared PTE
+    pt_remove(as, faultaddress);
+    if (pt_insert(as, faultaddress, pte)) {
+        panic("vm_fault_cow: pt_insert into an existing table failed\n");
+    }
+    VMSTAT_INC(cow_copies);
+
+    // Our old read-only entries elsewhere still point at the shared frame
+    tlb_invalidate_as_elsewhere(as);
+    tlb_load_entry(pte, true);
+    coremap[physical_page / PAGE_SIZE].ref_bit = true;
+    pte_unlock(pte);
+
+    if (last) {
+        pte_release(shared);
+    }
+    return 0;
+}
+
+/*
+ * Bring PTE's page back from swap, and with it, in the same disk read,
+ * any following pages of the address space that sit in the following
+ * swap slots. Called with PTE's lock held.
+ *
+ * Read-ahead pages only use frames that are already free; we never
+ * evict for a page nobody has asked for yet. They are locked before
+ * the faulting page gets its frame and none of them has a frame of its
+ * own yet, so no evictor can be waiting for any lock we hold. Locks are
+ * taken in address order, which is the same in every address space
+ * sharing these PTEs.
+ */
+static int swap_in_cluster(struct addrspace *as, struct page_table_entry *pte) {
+    struct page_table_entry *ptes[SWAP_CLUSTER];
+    paddr_t frames[SWAP_CLUSTER];
+    unsigned int slot = pte->diskpage_location;
+    unsigned int n = 1;
+
+    ptes[0] = pte;
+    while (n < SWAP_CLUSTER) {
+        vaddr_t vaddr = PTE_VADDR(pte) + n * PAGE_SIZE;
+        if (vaddr < PTE_VADDR(pte)) {
+            break; // Wrapped around the top of the address space
+        }
+
+        struct page_table_entry *next = pt_lookup(as, vaddr);
+        if (next == NULL) {
+            break;
+        }
+        pte_lock(next);
+        if (next->state != SWAPPED || next->diskpage_location != slot + n) {
+            pte_unlock(next);
+            break;
+        }
+
+        unsigned int frame = frame_cache_get();
+        if (frame == 0) {
+            pte_unlock(next);
+            break;
+        }
+        ptes[n] = next;
+        frames[n] = frame * PAGE_SIZE;
+        n++;
+    }
+
+    frames[0] = allocate_user_page(1, as, PTE_VADDR(pte), pte, false);
+    if (!frames[0]) {
+        for (unsigned int i = 1; i < n; i++) {
+            frame_cache_put(frames[i] / PAGE_SIZE);
+            pte_unlock(ptes[i]);
+        }
+        return ENOMEM; // Allocation failed
+    }
+
+    // Keep the swap slots: until the pages are written they are still good
+    if (swap_io(frames, n, slot, UIO_READ)) {
+        panic("Swap read failed");
+    }
+    VMSTAT_INC(swap_ins);
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (i > 0) {
+            // Not referenced yet: if nobody uses it, it is the first to go
+            claim_user_frame(frames[i], as, PTE_VADDR(ptes[i]), ptes[i], false);
+            VMSTAT_INC(swap_readahead);
+        }
+        ptes[i]->ppn = frames[i] / PAGE_SIZE;
+        ptes[i]->state = MAPPED;
+        ptes[i]->dirty = false;
+        if (i > 0) {
+            pte_unlock(ptes[i]);
+        }
+    }
+
+    return 0;
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress) {
+    struct addrspace *as = proc_getas();
+    if (as == NULL) {
+        return EFAULT; // No address space
+    }
+
+    VMSTAT_INC(faults);
+
+    faultaddress &= PAGE_FRAME; // Align faultaddress to page boundary
+    vaddr_t stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+    vaddr_t stacktop = USERSTACK;
+    struct region *region = NULL;
+
+    // Validate the fault address
+    if ((faultaddress < stackbase || faultaddress >= stacktop) &&
+        (faultaddress < as->heap_start || faultaddress >= as->heap_end)) {
+        region = as_find_region(as, faultaddress);
+        if (region == NULL) {
+            return EFAULT; // Invalid address
+        }
+    }
+
+    // Only mmap enforces protections; executables have always been writable
+    bool may_write = region == NULL || !region->mmapped || region->write;
+    if (region != NULL && region->mmapped) {
+        if (!region->read && !region->write && !region->execute) {
+            return EFAULT;
+        }
+        if (faulttype != VM_FAULT_READ && !region->write) {
+            return EFAULT;
+        }
     }
 
-    // Initialize a UIO structure for reading
-    struct iovec io_vector;
+    // Shared mappings are written in place; shared file pages track writes
+    bool shared_map = region != NULL && region->shared;
+    bool shared_file = shared_map && region->vnode != NULL;
+
+    struct page_table_entry *pte;
+    paddr_t physical_page = 0;
+    int result;
+
+    for (;;) {
+        pte = pt_lookup(as, faultaddress);
+        if (pte == NULL) {
+            /*
+             * A shared page cannot start out on the zero page: the
+             * sharing is through the PTE, and there would not be one
+             * to inherit across fork.
+             */
+            if (faulttype == VM_FAULT_READONLY) {
+                VMSTAT_INC(zero_map_writes); // Nothing else lacks a PTE
+            }
+            result = vm_fault_new_page(as, faultaddress, may_write && !shared_file,
+                                       faulttype == VM_FAULT_READ && !shared_map);
+            if (result != EAGAIN) {
+                return result;
+            }
+            continue;
+        }
+
+        pte_lock(pte);
+        if (pte->state == UNMAPPED) {
+            // Created empty by as_copy; see vm_fault_fill
+            KASSERT(shared_map);
+            pte_unlock(pte);
+            result = vm_fault_fill(as, faultaddress, pte);
+            if (result != EAGAIN) {
+                return result;
+            }
+            continue;
+        }
+        if (pte->state == MAPPED && frame_in_eviction(pte)) {
+            // Let the eviction finish, then fault the page back in
+            paddr_t evicting = PTE_PADDR(pte);
+            pte_unlock(pte);
+            wait_for_eviction(evicting, pte);
+            continue;
+        }
+        if (faulttype == VM_FAULT_READ || shared_map ||
+            (pte->refcount == 1 && !pte->cached)) {
+            break;
+        }
+
+        // Write to a copy-on-write page
+        pte_unlock(pte);
+        VMSTAT_INC(cow_faults);
+        result = vm_fault_cow(as, faultaddress, pte);
+        if (result != EAGAIN) {
+            return result;
+        }
+    }
+
+    if (pte->state == SWAPPED) { // Handle swapped page
+        result = swap_in_cluster(as, pte);
+        if (result) {
+            pte_unlock(pte);
+            return result;
+        }
+        physical_page = PTE_PADDR(pte);
+    } else { // Already mapped
+        KASSERT(pte->state == MAPPED);
+        physical_page = PTE_PADDR(pte);
+    }
+
+    // First write to a clean page: the copy in swap is about to go stale
+    if (faulttype != VM_FAULT_READ && !pte->dirty) {
+        KASSERT(pte->refcount == 1 || shared_map);
+        unmark_swap_bitmap(pte->diskpage_location);
+        pte->dirty = true;
+    }
+    if (faulttype != VM_FAULT_READ && shared_file) {
+        pte->file_dirty = true;
+    }
+
+    /*
+     * Copy-on-write and cached pages stay read-only so the first write
+     * comes back here to copy them, and so do clean pages, so that it
+     * can mark them dirty, and shared file pages, so that it can mark
+     * them for write-back.
+     */
+    bool writable;
+    if (shared_map) {
+        writable = pte->dirty && (!shared_file || pte->file_dirty);
+    } else {
+        writable = pte->refcount == 1 && pte->dirty && !pte->cached;
+    }
+    tlb_load_entry(pte, may_write && writable);
+    coremap[physical_page / PAGE_SIZE].ref_bit = true;
+    pte_unlock(pte);
+
+    return 0;
+}
+
+
+unsigned int coremap_memory_usage(void) {
+    spinlock_acquire(&coremap_lock);
+    unsigned int in_use = allocated_pages_count - cached_frame_count();
+    spinlock_release(&coremap_lock);
+
+    return in_use * PAGE_SIZE;
+}
+
+/*
+ * Move N pages between FRAMES and consecutive swap slots starting at
+ * SLOT, in a single VOP_READ or VOP_WRITE on the swap disk.
+ */
+int swap_disk_io(const paddr_t *frames, unsigned int n, unsigned int slot, enum uio_rw rw) {
+    struct iovec io_vectors[SWAP_CLUSTER];
     struct uio kernel_uio;
-    uio_kinit(&io_vector, &kernel_uio, (void *)PADDR_TO_KVADDR(page_paddr),
-              PAGE_SIZE, disk_index * PAGE_SIZE, UIO_READ);
+    int result;
+
+    KASSERT(n >= 1 && n <= SWAP_CLUSTER);
+    KASSERT(slot + n <= swap.slots);
+
+    for (unsigned int i = 0; i < n; i++) {
+        io_vectors[i].iov_kbase = (void *)PADDR_TO_KVADDR(frames[i]);
+        io_vectors[i].iov_len = PAGE_SIZE;
+    }
+    kernel_uio.uio_iov = io_vectors;
+    kernel_uio.uio_iovcnt = n;
+    kernel_uio.uio_offset = (off_t)slot * PAGE_SIZE;
+    kernel_uio.uio_resid = n * PAGE_SIZE;
+    kernel_uio.uio_segflg = UIO_SYSSPACE;
+    kernel_uio.uio_rw = rw;
+    kernel_uio.uio_space = NULL;
+
+    if (rw == UIO_READ) {
+        VMSTAT_INC(swap_read_ops);
+        result = VOP_READ(swap.vnode, &kernel_uio);
+    } else {
+        VMSTAT_INC(swap_write_ops);
+        result = VOP_WRITE(swap.vnode, &kernel_uio);
+    }
+    if (result == 0 && kernel_uio.uio_resid != 0) {
+        result = EIO;
+    }
+    return result;
+}
+
+/*
+ * Move N pages between FRAMES and consecutive swap slots starting at
+ * SLOT, by way of the compressed cache. Pages it has (or takes) never
+ * touch the disk; the others go in runs as long as the cache allows.
+ */
+static int swap_io(const paddr_t *frames, unsigned int n, unsigned int slot, enum uio_rw rw) {
+    unsigned int start = 0;
+    int result;
+
+    for (unsigned int i = 0; i <= n; i++) {
+        if (i < n) {
+            bool cached = (rw == UIO_READ) ? zswap_load(slot + i, frames[i])
+                                           : zswap_store(slot + i, frames[i]) == 0;
+            if (!cached) {
+                continue; // Joins the run going to disk
+            }
+        }
+        if (i > start) {
+            result = swap_disk_io(frames + start, i - start, slot + start, rw);
+            if (result) {
+                return result;
+            }
+        }
+        start = i + 1;
+    }
 
-    // Perform the read operation
-    int result = VOP_READ(swap.vnode, &kernel_uio);
+    return 0;
+}
+
+/*
+ * Reserve N consecutive free swap slots, searching onward from where
+ * the previous search left off so that successive clusters are laid
+ * out one after another. Returns ENOSPC if there is no such run.
+ */
+static int swap_alloc_run(unsigned int n, unsigned int *slot) {
+    static unsigned int swap_rotor;
+    unsigned int index, run = 0;
+
+    spinlock_acquire(&swap_lock);
+
+    index = swap_rotor;
+    for (unsigned int scanned = 0; scanned < swap.slots + n; scanned++, index++) {
+        if (index == swap.slots) {
+            index = 0;
+            run = 0; // A run cannot wrap around the end of the disk
+        }
+        if (bitmap_isset(swap.bitmap, index)) {
+            run = 0;
+            continue;
+        }
+        if (++run == n) {
+            *slot = index + 1 - n;
+            for (unsigned int i = 0; i < n; i++) {
+                bitmap_mark(swap.bitmap, *slot + i);
+            }
+            swap_rotor = (index + 1) % swap.slots;
+            spinlock_release(&swap_lock);
+            return 0;
+        }
+    }
+
+    spinlock_release(&swap_lock);
+    return ENOSPC;
+}
+
+int read_swap_disk(paddr_t page_paddr, unsigned int disk_index, bool unmark) {
+    // Ensure the bitmap entry for the disk index is set
+    if (!bitmap_isset(swap.bitmap, disk_index)) {
+        return EINVAL; // Invalid disk index
+    }
+
+    int result = swap_io(&page_paddr, 1, disk_index, UIO_READ);
     if (result) {
         return result; // Return the error code if read fails
     }
 
     // Optionally unmark the bitmap if the unmark flag is true
     if (unmark) {
-        spinlock_acquire(&swap_lock);
-        bitmap_unmark(swap.bitmap, disk_index);
-        spinlock_release(&swap_lock);
+        unmark_swap_bitmap(disk_index);
     }
 
     return 0; // Success
 }
 
 int write_swap_disk(paddr_t page_paddr, unsigned int *disk_index) {
-    // Allocate a free index in the swap bitmap
     unsigned int free_index;
-    spinlock_acquire(&swap_lock);
-    int allocation_result = bitmap_alloc(swap.bitmap, &free_index);
-    spinlock_release(&swap_lock);
-
-    if (allocation_result) {
-        return allocation_result; // Allocation failed, return the error code
+    int result = swap_alloc_run(1, &free_index);
+    if (result) {
+        return result; // Swap is full
     }
 
-    // Initialize a UIO structure for writing
-    struct iovec io_vector;
-    struct uio kernel_uio;
-    uio_kinit(&io_vector, &kernel_uio, (void *)PADDR_TO_KVADDR(page_paddr),
-              PAGE_SIZE, free_index * PAGE_SIZE, UIO_WRITE);
-
-    // Perform the write operation
-    int result = VOP_WRITE(swap.vnode, &kernel_uio);
+    result = swap_io(&page_paddr, 1, free_index, UIO_WRITE);
     if (result) {
+        unmark_swap_bitmap(free_index);
         return result; // Return the error code if write fails
     }
 
@@ -424,6 +1888,10 @@ int write_swap_disk(paddr_t page_paddr, unsigned int *disk_index) {
 }
 
 void unmark_swap_bitmap(unsigned int index) {
+    // Drop the cached copy while the slot is still ours: once it is
+    // unmarked, swap_alloc_run may hand it out and zswap_store into it
+    zswap_invalidate(index);
+
     // Acquire the lock before modifying the bitmap
     spinlock_acquire(&swap_lock);
 
@@ -435,77 +1903,527 @@ void unmark_swap_bitmap(unsigned int index) {
     spinlock_release(&swap_lock);
 }
 
-paddr_t evict_page(void) {
-    struct addrspace *evicted_as;
-    vaddr_t evicted_vaddr;
-    paddr_t evicted_paddr;
-    struct page_table_entry *pte = NULL;
-    unsigned int disk_block_index;
-    int error;
+/*
+ * Page replacement policies. A policy picks the victim that evict_page
+ * starts its cluster from, and says which other frames are cold enough
+ * to go along with it. All of them share the hand, eviction_pointer,
+ * and the reference bits that faults set in the coremap.
+ *
+ * pick is called with coremap_lock held. It returns the coremap index
+ * of the victim, or 0 if it found nothing evictable, setting *BUSY if
+ * some frames were skipped only because another thread is evicting
+ * them, i.e. waiting may help. It only ever returns a frame that is
+ * "used".
+ */
+struct vm_policy {
+    const char *name;
+    unsigned int (*pick)(bool *busy);
+    bool (*cold)(unsigned int frame);
+};
+
+static unsigned int clock_pick(bool *busy);
+static unsigned int esc_pick(bool *busy);
+static unsigned int aging_pick(bool *busy);
+static bool clock_cold(unsigned int frame);
+static bool aging_cold(unsigned int frame);
+
+static const struct vm_policy vm_policies[] = {
+    { "clock", clock_pick, clock_cold },
+    { "esc", esc_pick, clock_cold },
+    { "aging", aging_pick, aging_cold },
+};
+#define NUM_POLICIES (sizeof(vm_policies) / sizeof(vm_policies[0]))
+
+static const struct vm_policy *vm_policy = &vm_policies[0];
+
+int vm_set_policy(const char *name) {
+    for (unsigned int i = 0; i < NUM_POLICIES; i++) {
+        if (!strcmp(vm_policies[i].name, name)) {
+            spinlock_acquire(&coremap_lock);
+            vm_policy = &vm_policies[i];
+            spinlock_release(&coremap_lock);
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+const char *vm_get_policy(void) {
+    return vm_policy->name;
+}
+
+/* Name of policy I, or NULL past the last one */
+const char *vm_policy_name(unsigned int i) {
+    return i < NUM_POLICIES ? vm_policies[i].name : NULL;
+}
+
+/* Move the hand on, and return the frame it was pointing at */
+static unsigned int clock_advance(void) {
+    unsigned int first_page = memory_start / PAGE_SIZE;
+    unsigned int last_page = memory_end / PAGE_SIZE;
+
+    if (eviction_pointer < first_page || eviction_pointer >= last_page) {
+        eviction_pointer = first_page;
+    }
+    return eviction_pointer++;
+}
+
+static unsigned int resident_frames(void) {
+    return memory_end / PAGE_SIZE - memory_start / PAGE_SIZE;
+}
+
+static bool clock_cold(unsigned int frame) {
+    return !coremap[frame].ref_bit;
+}
+
+/*
+ * Clock: take the first unreferenced frame, clearing reference bits
+ * on the way. Two rotations: the first may only be clearing them.
+ */
+static unsigned int clock_pick(bool *busy) {
+    unsigned int npages = resident_frames();
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    *busy = false;
+    for (unsigned int scanned = 0; scanned < 2 * npages; scanned++) {
+        unsigned int index = clock_advance();
+        struct coremap_page *current_page = &coremap[index];
+
+        if (current_page->state == in_eviction) {
+            *busy = true;
+            continue;
+        }
+        if (current_page->state != used) {
+            continue;
+        }
+
+        if (!current_page->ref_bit) {
+            return index; // Found a page to evict
+        }
+
+        // Reset the reference bit and give the page a second chance
+        current_page->ref_bit = false;
+    }
+
+    return 0;
+}
+
+/*
+ * Enhanced second chance: prefer frames that are neither referenced
+ * nor dirty, since they can go without a swap write, then ones that
+ * are dirty but not referenced. A rotation looking for the first kind
+ * leaves reference bits alone; one looking for the second clears them
+ * as it goes, so the next pair of rotations finds something.
+ *
+ * A frame is dirty if its page has no valid copy in swap. That is
+ * read from the PTE without its lock, which is fine for a hint; the
+ * PTE cannot go away while its frame is "used" and we hold
+ * coremap_lock.
+ */
+static unsigned int esc_pick(bool *busy) {
+    unsigned int npages = resident_frames();
 
     KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-    // Identify a page to evict using the clock algorithm
-    while (true) {
-        struct coremap_page *current_page = &coremap[eviction_pointer];
+    *busy = false;
+    for (unsigned int round = 0; round < 4; round++) {
+        bool want_dirty = round % 2 == 1;
+
+        for (unsigned int scanned = 0; scanned < npages; scanned++) {
+            unsigned int index = clock_advance();
+            struct coremap_page *current_page = &coremap[index];
+
+            if (current_page->state == in_eviction) {
+                *busy = true;
+                continue;
+            }
+            if (current_page->state != used) {
+                continue;
+            }
 
-        if (current_page->state == used && !current_page->ref_bit) {
-            break; // Found a page to evict
+            if (!current_page->ref_bit &&
+                (bool)current_page->owner_pte->dirty == want_dirty) {
+                return index;
+            }
+            if (want_dirty) {
+                current_page->ref_bit = false;
+            }
         }
+    }
+
+    return 0;
+}
+
+/*
+ * Aging (LRU approximation): in the background, every resident frame's
+ * age is shifted right with its reference bit shifted in at the top,
+ * and the bit is cleared (see vm_age_tick). The frame with the lowest
+ * age has gone unreferenced longest and is taken, the first one from
+ * the hand on among equals. Cold frames are those not referenced
+ * during the last four agings.
+ */
+static bool aging_cold(unsigned int frame) {
+    return (coremap[frame].age & 0xf0) == 0;
+}
+
+static unsigned int aging_pick(bool *busy) {
+    unsigned int npages = resident_frames();
+    unsigned int victim = 0;
+    unsigned int victim_age = 0x100;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-        // Reset the reference bit if the page is in use
-        if (current_page->state == used) {
-            current_page->ref_bit = false;
+    *busy = false;
+    for (unsigned int scanned = 0; scanned < npages && victim_age > 0; scanned++) {
+        unsigned int index = clock_advance();
+        if (coremap[index].state == in_eviction) {
+            *busy = true;
+        }
+        if (coremap[index].state == used && coremap[index].age < victim_age) {
+            victim = index;
+            victim_age = coremap[index].age;
         }
+    }
+    if (victim != 0) {
+        // Start looking just past this victim next time
+        eviction_pointer = victim + 1;
+    }
+
+    return victim;
+}
+
+/*
+ * Called from hardclock() on every tick. While the aging policy is in
+ * use, the boot CPU ages the next AGING_BATCH frames, so that the work
+ * under coremap_lock with interrupts off stays bounded however much
+ * memory there is; with HZ at 100 a machine with 4M of RAM has every
+ * frame aged about six times a second. The other policies only use
+ * the reference bits as they pass, and need nothing here.
+ */
+#define AGING_BATCH 64
+
+static unsigned int aging_hand;
+
+void vm_age_tick(void) {
+    unsigned int first_page = memory_start / PAGE_SIZE;
+    unsigned int last_page = memory_end / PAGE_SIZE;
 
-        // Increment eviction pointer and wrap around if needed
-        eviction_pointer = (eviction_pointer + 1) % (memory_end / PAGE_SIZE);
+    if (vm_policy->pick != aging_pick || curcpu->c_number != 0) {
+        return;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    for (unsigned int i = 0; i < AGING_BATCH; i++) {
+        if (aging_hand < first_page || aging_hand >= last_page) {
+            aging_hand = first_page;
+        }
+        struct coremap_page *page = &coremap[aging_hand++];
+        if (page->state != used) {
+            continue;
+        }
+        page->age = (page->age >> 1) | (page->ref_bit ? 0x80 : 0);
+        page->ref_bit = false;
     }
+    spinlock_release(&coremap_lock);
+}
 
-    // Gather information about the page being evicted
-    struct coremap_page *evict_page = &coremap[eviction_pointer];
-    KASSERT(evict_page->state == used);
+/*
+ * Evict user pages to swap to make room for an allocation.
+ *
+ * Called with coremap_lock held; the lock is dropped while pages are
+ * written out and is held again on return. Besides the replacement
+ * policy's victim, up to SWAP_CLUSTER - 1 cold frames of the same
+ * address space found just past it are evicted too, and all the dirty
+ * ones go to consecutive swap slots in one write. Frames are mostly
+ * handed out in order, so these tend to be neighbours in the address
+ * space as well.
+ *
+ * One reclaimed frame is returned, left in_eviction so nobody else can
+ * take it; the caller is expected to claim it before releasing
+ * coremap_lock. The others go back on the free lists. Returns 0 if no
+ * frame could be reclaimed.
+ *
+ * The evictor holds at most one PTE lock at a time and never during the
+ * disk write. While a page is being written its frame is in_eviction
+ * and its TLB entries are gone on every CPU, so a faulter waits (see
+ * frame_in_eviction) instead of touching it.
+ */
+paddr_t evict_page(void) {
+    unsigned int cluster[SWAP_CLUSTER];
+    struct page_table_entry *ptes[SWAP_CLUSTER];
+    bool evicted[SWAP_CLUSTER];
+    unsigned int dirty[SWAP_CLUSTER];
+    paddr_t frames[SWAP_CLUSTER];
+    unsigned int ncluster, ndirty, nwritten, victim, slot, i, j;
+    paddr_t evicted_paddr = 0;
+    uint32_t tlb_cpus = 0;
+    bool busy;
 
-    evicted_as = evict_page->owner_addrspace;
-    evicted_vaddr = evict_page->owner_vaddr;
-    evicted_paddr = eviction_pointer * PAGE_SIZE;
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-    evict_page->state = in_eviction;
+    // Let the replacement policy pick the page to evict
+    while ((victim = vm_policy->pick(&busy)) == 0) {
+        if (!busy) {
+            return 0; // Everything is fixed or free-but-claimed
+        }
+        // Other faulters hold every candidate; wait for one to finish
+        VMSTAT_INC(eviction_waits);
+        wchan_sleep(eviction_wchan, &coremap_lock);
+    }
+    KASSERT(coremap[victim].state == used);
+
+    // Gather cluster mates from the same address space
+    struct addrspace *evicted_as = coremap[victim].owner_addrspace;
+    ncluster = 0;
+    cluster[ncluster++] = victim;
+    for (i = victim + 1; i < end_frame && i <= victim + SWAP_CLUSTER_WINDOW &&
+                         ncluster < SWAP_CLUSTER; i++) {
+        if (coremap[i].state == used && vm_policy->cold(i) &&
+            coremap[i].owner_addrspace == evicted_as) {
+            cluster[ncluster++] = i;
+        }
+    }
 
-    // Move the eviction pointer forward
-    eviction_pointer = (eviction_pointer + 1) % (memory_end / PAGE_SIZE);
+    /*
+     * Once a frame is in_eviction its owner cannot free it or the PTE
+     * (see release_pte_backing), so the PTEs stay valid while we sleep
+     * on their locks and on the disk.
+     */
+    for (i = 0; i < ncluster; i++) {
+        ptes[i] = coremap[cluster[i]].owner_pte;
+        KASSERT(ptes[i] != NULL);
+        coremap[cluster[i]].state = in_eviction;
+        evicted[i] = false;
+    }
 
     spinlock_release(&coremap_lock);
 
-    // Locate the page table entry corresponding to the evicted page
-    for (pte = evicted_as->start_page_table; pte != NULL; pte = pte->next) {
-        if (pte->as_vpage == evicted_vaddr) {
-            lock_acquire(pte->lock);
-            KASSERT(pte->as_ppage == evicted_paddr);
-            KASSERT(pte->state == MAPPED);
-            break;
+    /*
+     * Unmap every page. A clean page still has an up-to-date copy in
+     * its swap slot, and cannot have been written since: clean pages
+     * are only ever mapped read-only. It is done already; the dirty
+     * ones are written below.
+     */
+    ndirty = 0;
+    for (i = 0; i < ncluster; i++) {
+        struct page_table_entry *pte = ptes[i];
+
+        pte_lock(pte);
+        KASSERT(pte->ppn == cluster[i]);
+        KASSERT(pte->state == MAPPED);
+
+        // No new TLB entries can appear now that the frame is in_eviction
+        tlb_cpus |= pte->tlb_cpus;
+        pte->tlb_cpus = 0;
+        frames[i] = PTE_PADDR(pte);
+        if (!pte->dirty) {
+            pte->state = SWAPPED;
+            evicted[i] = true;
+            VMSTAT_INC(clean_evictions);
+        } else {
+            dirty[ndirty++] = i;
         }
+        pte_unlock(pte);
     }
-    KASSERT(pte != NULL);
 
-    // Write the evicted page to the swap disk
-    tlb_invalidate_entry(evicted_vaddr);
-    error = write_swap_disk(evicted_paddr, &disk_block_index);
-    if (error) {
-        panic("Unable to write to swap disk");
+    /*
+     * Any CPU that ran an address space sharing these pages may still
+     * have them in its TLB, and may be writing the dirty ones right
+     * now. Stop it before the pages are written out or reused.
+     */
+    tlb_shootdown_frames(frames, ncluster, tlb_cpus);
+
+    // Lay the dirty pages out on disk in address order
+    for (i = 1; i < ndirty; i++) {
+        unsigned int d = dirty[i];
+        for (j = i; j > 0 && ptes[dirty[j - 1]]->vpn > ptes[d]->vpn; j--) {
+            dirty[j] = dirty[j - 1];
+        }
+        dirty[j] = d;
     }
 
-    // Update the page table entry state
-    pte->diskpage_location = disk_block_index;
-    pte->state = SWAPPED;
-    lock_release(pte->lock);
+    /*
+     * Write them out, as one run if the swap disk has room for it and
+     * in smaller runs if it is fragmented. If swap is full (or broken)
+     * the remaining pages simply stay where they are.
+     */
+    nwritten = 0;
+    while (nwritten < ndirty) {
+        unsigned int n = ndirty - nwritten;
+        while (swap_alloc_run(n, &slot)) {
+            n /= 2;
+            if (n == 0) {
+                break;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            frames[i] = cluster[dirty[nwritten + i]] * PAGE_SIZE;
+        }
+        if (swap_io(frames, n, slot, UIO_WRITE)) {
+            for (i = 0; i < n; i++) {
+                unmark_swap_bitmap(slot + i);
+            }
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            unsigned int d = dirty[nwritten + i];
+            pte_lock(ptes[d]);
+            ptes[d]->diskpage_location = slot + i;
+            ptes[d]->state = SWAPPED;
+            ptes[d]->dirty = false;
+            pte_unlock(ptes[d]);
+            evicted[d] = true;
+            VMSTAT_INC(swap_outs);
+        }
+        nwritten += n;
+    }
 
     spinlock_acquire(&coremap_lock);
 
+    /*
+     * Detach the frames from their old owners. Keep one for the caller
+     * and free the rest; pages that could not be written go back to
+     * being ordinary resident pages. Then let any waiters proceed.
+     */
+    for (i = 0; i < ncluster; i++) {
+        unsigned int frame = cluster[i];
+
+        if (!evicted[i]) {
+            coremap[frame].state = used;
+            continue;
+        }
+
+        coremap[frame].owner_addrspace = NULL;
+        coremap[frame].owner_vaddr = 0;
+        coremap[frame].owner_pte = NULL;
+        VMSTAT_INC(evictions);
+
+        if (evicted_paddr == 0) {
+            evicted_paddr = frame * PAGE_SIZE;
+        } else {
+            frame_free_range(frame, 1);
+            allocated_pages_count--;
+        }
+    }
+    wchan_wakeall(eviction_wchan, &coremap_lock);
+
     return evicted_paddr;
 }
 
+/*
+ * What it costs to keep track of user pages: PTEs, whose size is one of
+ * kmalloc's, plus page table pages, per resident user page.
+ */
+static void vm_print_pt_overhead(void) {
+    unsigned int ptes, tables, resident = 0;
+
+    pt_memory_usage(&ptes, &tables);
+
+    spinlock_acquire(&coremap_lock);
+    for (unsigned int i = first_frame; i < end_frame; i++) {
+        if (coremap[i].state == used || coremap[i].state == in_eviction) {
+            resident++;
+        }
+    }
+    spinlock_release(&coremap_lock);
+
+    unsigned long bytes = (unsigned long)ptes * sizeof(struct page_table_entry) +
+                          (unsigned long)tables * PAGE_SIZE;
+    kprintf("    page table memory: %10lu bytes (%u PTEs of %u bytes, %u table pages)\n",
+            bytes, ptes, (unsigned)sizeof(struct page_table_entry), tables);
+    if (resident > 0) {
+        kprintf("    ...per resident page: %8lu bytes (%u resident)\n",
+                bytes / resident, resident);
+    }
+}
+
+/* Sum the per-CPU counters into SNAPSHOT */
+void vm_getstats(struct vm_stats *snapshot) {
+    // struct vm_stats is all unsigned counters; sum it field by field
+    bzero(snapshot, sizeof(*snapshot));
+    for (unsigned int i = 0; i < MAXCPUS; i++) {
+        const unsigned *src = (const unsigned *)&stats[i];
+        unsigned *dst = (unsigned *)snapshot;
+        for (unsigned int j = 0; j < sizeof(*snapshot) / sizeof(unsigned); j++) {
+            dst[j] += src[j];
+        }
+    }
+}
+
+/*
+ * Print paging counters and their rates since the last reset.
+ */
+void vm_printstats(void) {
+    struct vm_stats snapshot;
+    struct timespec now, elapsed;
+    unsigned long ms;
+
+    vm_getstats(&snapshot);
+
+    gettime(&now);
+    timespec_sub(&now, &stats_start, &elapsed);
+    ms = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+    if (ms == 0) {
+        ms = 1;
+    }
+
+    kprintf("VM statistics over %lu.%03lu seconds (%s replacement):\n",
+            ms / 1000, ms % 1000, vm_policy->name);
+    kprintf("    faults:            %10u  (%lu/s)\n", snapshot.faults,
+            (unsigned long)snapshot.faults * 1000 / ms);
+    kprintf("    zero fills:        %10u\n", snapshot.zero_fills);
+    kprintf("    zero page maps:    %10u\n", snapshot.zero_maps);
+    kprintf("    zero page writes:  %10u\n", snapshot.zero_map_writes);
+    kprintf("    pre-zeroed hits:   %10u\n", snapshot.zero_pool_hits);
+    kprintf("    pre-zeroed misses: %10u\n", snapshot.zero_pool_misses);
+    kprintf("    idle zeroings:     %10u\n", snapshot.zero_pool_fills);
+    kprintf("    file fills:        %10u\n", snapshot.file_fills);
+    kprintf("    text pages shared: %10u\n", snapshot.text_shares);
+    kprintf("    file write-backs:  %10u\n", snapshot.file_writebacks);
+    kprintf("    swap ins:          %10u  (%lu/s)\n", snapshot.swap_ins,
+            (unsigned long)snapshot.swap_ins * 1000 / ms);
+    kprintf("    swap outs:         %10u  (%lu/s)\n", snapshot.swap_outs,
+            (unsigned long)snapshot.swap_outs * 1000 / ms);
+    kprintf("    swap read-ahead:   %10u\n", snapshot.swap_readahead);
+    kprintf("    swap disk reads:   %10u\n", snapshot.swap_read_ops);
+    kprintf("    swap disk writes:  %10u\n", snapshot.swap_write_ops);
+    kprintf("    clean evictions:   %10u  (swap writes saved)\n",
+            snapshot.clean_evictions);
+    zswap_printstats();
+    kprintf("    cow faults:        %10u\n", snapshot.cow_faults);
+    kprintf("    cow copies:        %10u\n", snapshot.cow_copies);
+    kprintf("    TLB flushes:       %10u\n", snapshot.tlb_flushes);
+    kprintf("    TLB shootdowns:    %10u\n", snapshot.tlb_shootdowns);
+    kprintf("    ASID rollovers:    %10u\n", snapshot.asid_rollovers);
+    kprintf("    evictions:         %10u\n", snapshot.evictions);
+    kprintf("    eviction waits:    %10u\n", snapshot.eviction_waits);
+    kprintf("    eviction failures: %10u\n", snapshot.eviction_failures);
+    kprintf("    direct reclaims:   %10u\n", snapshot.direct_reclaims);
+    kprintf("    pageout reclaims:  %10u\n", snapshot.background_reclaims);
+    kprintf("    memory in use:     %10u bytes\n", coremap_memory_usage());
+    vm_print_pt_overhead();
+}
+
+void vm_resetstats(void) {
+    bzero(stats, sizeof(stats));
+    gettime(&stats_start);
+    zswap_resetstats();
+}
+
+/*
+ * Shootdowns sent by tlb_shootdown_frames, or the whole TLB if too
+ * many piled up. Called from interprocessor_interrupt.
+ */
+void vm_tlbshootdown_all(void) {
+    tlb_invalidate_all();
+}
 
-void vm_tlbshootdown(const struct tlbshootdown * ts) {
-	(void)ts;
+void vm_tlbshootdown(const struct tlbshootdown *ts) {
+    tlb_invalidate_frame(ts->ts_paddr);
 }
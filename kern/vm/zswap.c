@@ -0,0 +1,401 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vm.h>
+
+/*
+ * Compressed swap cache.
+ *
+ * Pages on their way to the swap disk are compressed into a pool of
+ * kernel frames instead, and only reach the disk when the pool is full
+ * and they are the oldest thing in it. Swap-ins look in the pool first.
+ *
+ * The cache sits underneath swap slots rather than beside them: a page
+ * still gets a slot when it is evicted, and the slot stays reserved in
+ * the bitmap for as long as the page lives there, exactly as if it had
+ * been written out. An entry is a copy of what the slot "holds", keyed
+ * by slot number; it stays when the page is read back, since a clean
+ * page keeps its slot and may be evicted again without a write, and it
+ * goes away when the slot is freed. Spilling an entry writes it to its
+ * own slot, so nobody above this file can tell whether a slot's data is
+ * on disk or here.
+ *
+ * The pool is allocated once, at boot, as a fraction of memory. Each
+ * frame is split into ZSWAP_CHUNKS_PER_FRAME chunks and a compressed
+ * page takes a run of them inside one frame. A page that does not
+ * compress to ZSWAP_MAX_CHUNKS chunks is not worth keeping and goes
+ * straight to disk.
+ *
+ * Everything is under zswap_lock, which is taken last: nothing here
+ * takes another lock or allocates memory while holding it, because the
+ * callers are evicting pages to make memory in the first place. Spills
+ * do their disk write holding it, which keeps a load from ever missing
+ * a page that is halfway between the pool and the disk.
+ */
+
+#define ZSWAP_FRACTION 16           // Pool size, as a fraction of memory
+#define ZSWAP_CHUNK 512
+#define ZSWAP_CHUNKS_PER_FRAME (PAGE_SIZE / ZSWAP_CHUNK)
+#define ZSWAP_MAX_CHUNKS (ZSWAP_CHUNKS_PER_FRAME / 2)
+
+#define ZSWAP_WORDS (PAGE_SIZE / sizeof(uint32_t))
+#define ZSWAP_TAG_BYTES (ZSWAP_WORDS / 4)
+
+// Per-word tags of the compressed format, two bits each
+#define TAG_ZERO 0      // The word is 0
+#define TAG_REPEAT 1    // Same as the word before
+#define TAG_DELTA 2     // Within 16 bits of the word before; 2 bytes follow
+#define TAG_LITERAL 3   // Anything else; 4 bytes follow
+
+/*
+ * Entries are linked oldest to newest for spilling. Links and the slot
+ * map hold entry index + 1, so that 0 means none.
+ */
+struct zswap_entry {
+    unsigned int slot;
+    unsigned int frame;         // Index into the pool
+    uint8_t chunk;              // First chunk in that frame
+    uint8_t nchunks;
+    uint16_t length;            // Compressed size in bytes
+    unsigned int older, newer;
+};
+
+static struct lock *zswap_lock;
+
+static vaddr_t pool;
+static unsigned int pool_frames;
+static uint8_t *chunk_map;      // Bit per chunk, per pool frame
+static unsigned int chunk_rotor;
+static unsigned int chunks_used;
+
+static struct zswap_entry *entries;
+static unsigned int free_entries;   // Chained through older
+static unsigned int oldest, newest;
+static unsigned int nentries;
+static unsigned int *slot_map;
+
+static uint8_t *scratch;        // Compression output, ZSWAP_MAX_CHUNKS chunks
+static paddr_t spill_page;      // A page is decompressed here to spill it
+
+static struct zswap_stats {
+    unsigned stores;            // Pages taken into the pool
+    unsigned rejects;           // ...and turned away as incompressible
+    unsigned hits;              // Swap-ins served from the pool
+    unsigned misses;            // ...and from the disk
+    unsigned spills;            // Pages pushed out of the pool to disk
+    unsigned long long bytes_in;    // Uncompressed bytes stored
+    unsigned long long bytes_out;   // ...and what they compressed to
+} zstats;
+
+/*
+ * Compress the page at SRC into DST, which has room for LIMIT bytes,
+ * and return the compressed length, or 0 if it does not fit. Modelled
+ * on WKdm: most words in memory are zero, repeat their neighbour or
+ * differ from it in the low bits, so each word gets a 2-bit tag and
+ * only the rest of it goes into the output.
+ */
+static unsigned int zswap_compress(const uint32_t *src, uint8_t *dst, unsigned int limit) {
+    uint8_t *tags = dst;
+    uint8_t *out = dst + ZSWAP_TAG_BYTES;
+    uint8_t *end = dst + limit;
+    uint32_t prev = 0;
+
+    bzero(tags, ZSWAP_TAG_BYTES);
+    for (unsigned int i = 0; i < ZSWAP_WORDS; i++) {
+        uint32_t word = src[i];
+        int32_t delta = (int32_t)(word - prev);
+        unsigned int tag;
+
+        if (word == 0) {
+            tag = TAG_ZERO;
+        } else if (word == prev) {
+            tag = TAG_REPEAT;
+        } else if (delta >= -32768 && delta <= 32767) {
+            if (out + 2 > end) {
+                return 0;
+            }
+            out[0] = delta & 0xff;
+            out[1] = (delta >> 8) & 0xff;
+            out += 2;
+            tag = TAG_DELTA;
+        } else {
+            if (out + 4 > end) {
+                return 0;
+            }
+            memcpy(out, &word, 4);
+            out += 4;
+            tag = TAG_LITERAL;
+        }
+        tags[i / 4] |= tag << ((i % 4) * 2);
+        prev = word;
+    }
+
+    return out - dst;
+}
+
+static void zswap_decompress(const uint8_t *src, uint32_t *dst) {
+    const uint8_t *tags = src;
+    const uint8_t *in = src + ZSWAP_TAG_BYTES;
+    uint32_t prev = 0;
+
+    for (unsigned int i = 0; i < ZSWAP_WORDS; i++) {
+        uint32_t word;
+
+        switch ((tags[i / 4] >> ((i % 4) * 2)) & 3) {
+        case TAG_ZERO:
+            word = 0;
+            break;
+        case TAG_REPEAT:
+            word = prev;
+            break;
+        case TAG_DELTA:
+            word = prev + (int16_t)(in[0] | (in[1] << 8));
+            in += 2;
+            break;
+        default:
+            memcpy(&word, in, 4);
+            in += 4;
+            break;
+        }
+        dst[i] = word;
+        prev = word;
+    }
+}
+
+void zswap_bootstrap(unsigned int ram_pages) {
+    pool_frames = ram_pages / ZSWAP_FRACTION;
+    if (pool_frames == 0) {
+        return;
+    }
+    unsigned int max_entries = pool_frames * ZSWAP_CHUNKS_PER_FRAME;
+
+    zswap_lock = lock_create("zswap");
+    pool = alloc_kpages(pool_frames);
+    vaddr_t spill = alloc_kpages(1);
+    chunk_map = kmalloc(pool_frames);
+    entries = kmalloc(max_entries * sizeof(struct zswap_entry));
+    slot_map = kmalloc(swap.slots * sizeof(unsigned int));
+    scratch = kmalloc(ZSWAP_MAX_CHUNKS * ZSWAP_CHUNK);
+    if (zswap_lock == NULL || pool == 0 || spill == 0 || chunk_map == NULL ||
+        entries == NULL || slot_map == NULL || scratch == NULL) {
+        panic("zswap_bootstrap: Out of memory\n");
+    }
+    spill_page = spill - MIPS_KSEG0;
+
+    bzero(chunk_map, pool_frames);
+    bzero(slot_map, swap.slots * sizeof(unsigned int));
+    for (unsigned int i = 0; i < max_entries; i++) {
+        entries[i].older = (i + 1 < max_entries) ? i + 2 : 0;
+    }
+    free_entries = 1;
+}
+
+/*
+ * Find NCHUNKS free chunks in a row within one pool frame, starting
+ * the search where the last one succeeded, and mark them used.
+ */
+static bool zswap_alloc_chunks(unsigned int nchunks, unsigned int *frame, unsigned int *chunk) {
+    unsigned int mask = (1 << nchunks) - 1;
+
+    for (unsigned int scanned = 0; scanned < pool_frames; scanned++) {
+        unsigned int f = (chunk_rotor + scanned) % pool_frames;
+        for (unsigned int c = 0; c + nchunks <= ZSWAP_CHUNKS_PER_FRAME; c++) {
+            if ((chunk_map[f] & (mask << c)) == 0) {
+                chunk_map[f] |= mask << c;
+                chunks_used += nchunks;
+                chunk_rotor = f;
+                *frame = f;
+                *chunk = c;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static uint8_t *zswap_data(struct zswap_entry *e) {
+    return (uint8_t *)(pool + e->frame * PAGE_SIZE + e->chunk * ZSWAP_CHUNK);
+}
+
+static void zswap_remove(unsigned int idx) {
+    struct zswap_entry *e = &entries[idx - 1];
+
+    KASSERT(lock_do_i_hold(zswap_lock));
+
+    chunk_map[e->frame] &= ~(((1 << e->nchunks) - 1) << e->chunk);
+    chunks_used -= e->nchunks;
+    slot_map[e->slot] = 0;
+
+    if (e->older) {
+        entries[e->older - 1].newer = e->newer;
+    } else {
+        oldest = e->newer;
+    }
+    if (e->newer) {
+        entries[e->newer - 1].older = e->older;
+    } else {
+        newest = e->older;
+    }
+
+    e->older = free_entries;
+    free_entries = idx;
+    nentries--;
+}
+
+/*
+ * Write the oldest entry out to its slot and drop it from the pool.
+ */
+static int zswap_spill(void) {
+    struct zswap_entry *e = &entries[oldest - 1];
+    int result;
+
+    KASSERT(oldest != 0);
+
+    zswap_decompress(zswap_data(e), (uint32_t *)PADDR_TO_KVADDR(spill_page));
+    result = swap_disk_io(&spill_page, 1, e->slot, UIO_WRITE);
+    if (result) {
+        return result;
+    }
+    zswap_remove(oldest);
+    zstats.spills++;
+
+    return 0;
+}
+
+bool zswap_load(unsigned int slot, paddr_t paddr) {
+    if (pool_frames == 0) {
+        return false;
+    }
+    KASSERT(slot < swap.slots);
+
+    lock_acquire(zswap_lock);
+    unsigned int idx = slot_map[slot];
+    if (idx == 0) {
+        zstats.misses++;
+        lock_release(zswap_lock);
+        return false;
+    }
+    zswap_decompress(zswap_data(&entries[idx - 1]), (uint32_t *)PADDR_TO_KVADDR(paddr));
+    zstats.hits++;
+    lock_release(zswap_lock);
+
+    return true;
+}
+
+int zswap_store(unsigned int slot, paddr_t paddr) {
+    unsigned int length, nchunks, frame, chunk, idx;
+    int result;
+
+    if (pool_frames == 0) {
+        return ENOSPC;
+    }
+    KASSERT(slot < swap.slots);
+
+    lock_acquire(zswap_lock);
+
+    // Whatever was in the slot before is being overwritten either way
+    if (slot_map[slot] != 0) {
+        zswap_remove(slot_map[slot]);
+    }
+
+    length = zswap_compress((const uint32_t *)PADDR_TO_KVADDR(paddr), scratch,
+                            ZSWAP_MAX_CHUNKS * ZSWAP_CHUNK);
+    if (length == 0) {
+        zstats.rejects++;
+        lock_release(zswap_lock);
+        return ENOSPC;
+    }
+    nchunks = (length + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+
+    while (!zswap_alloc_chunks(nchunks, &frame, &chunk)) {
+        result = zswap_spill();
+        if (result) {
+            lock_release(zswap_lock);
+            return result;
+        }
+    }
+
+    idx = free_entries;
+    KASSERT(idx != 0);
+    struct zswap_entry *e = &entries[idx - 1];
+    free_entries = e->older;
+
+    e->slot = slot;
+    e->frame = frame;
+    e->chunk = chunk;
+    e->nchunks = nchunks;
+    e->length = length;
+    memcpy(zswap_data(e), scratch, length);
+
+    e->older = newest;
+    e->newer = 0;
+    if (newest) {
+        entries[newest - 1].newer = idx;
+    } else {
+        oldest = idx;
+    }
+    newest = idx;
+    slot_map[slot] = idx;
+    nentries++;
+
+    zstats.stores++;
+    zstats.bytes_in += PAGE_SIZE;
+    zstats.bytes_out += length;
+    lock_release(zswap_lock);
+
+    return 0;
+}
+
+void zswap_invalidate(unsigned int slot) {
+    if (pool_frames == 0 || slot >= swap.slots) {
+        return;
+    }
+
+    lock_acquire(zswap_lock);
+    if (slot_map[slot] != 0) {
+        zswap_remove(slot_map[slot]);
+    }
+    lock_release(zswap_lock);
+}
+
+void zswap_printstats(void) {
+    struct zswap_stats snapshot;
+    unsigned int used, capacity, held;
+
+    if (pool_frames == 0) {
+        return;
+    }
+
+    lock_acquire(zswap_lock);
+    snapshot = zstats;
+    used = chunks_used;
+    held = nentries;
+    lock_release(zswap_lock);
+    capacity = pool_frames * ZSWAP_CHUNKS_PER_FRAME;
+
+    unsigned long long ratio = snapshot.bytes_out == 0 ? 0 :
+                               snapshot.bytes_in * 100 / snapshot.bytes_out;
+    unsigned int lookups = snapshot.hits + snapshot.misses;
+    unsigned int hit_rate = lookups == 0 ? 0 : snapshot.hits * 100ULL / lookups;
+
+    kprintf("    zswap stores:      %10u  (%u rejected)\n", snapshot.stores,
+            snapshot.rejects);
+    kprintf("    zswap ratio:       %7llu.%02llu:1\n", ratio / 100, ratio % 100);
+    kprintf("    zswap hits:        %10u  (%u%% of swap-ins)\n", snapshot.hits,
+            hit_rate);
+    kprintf("    zswap spills:      %10u\n", snapshot.spills);
+    kprintf("    zswap pool:        %10u pages in %u/%u chunks of %u frames\n",
+            held, used, capacity, pool_frames);
+}
+
+void zswap_resetstats(void) {
+    if (pool_frames == 0) {
+        return;
+    }
+
+    lock_acquire(zswap_lock);
+    bzero(&zstats, sizeof(zstats));
+    lock_release(zswap_lock);
+}
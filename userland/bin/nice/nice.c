@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nice - run a command with a different scheduling priority
+ * usage: nice [-n increment] command [args...]
+ *        nice
+ *
+ * Adds the increment, 10 by default, to our niceness and runs the
+ * command, which inherits it. Positive increments make the command
+ * yield the cpu to others; negative ones, the opposite. With no
+ * command, prints the current niceness instead.
+ *
+ * This program uses these system calls:
+ *    getpriority setpriority execv write _exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/resource.h>
+
+#define DEFAULT_INCREMENT 10
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: nice [-n increment] command [args...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int increment = DEFAULT_INCREMENT;
+	int prio;
+	int i = 1;
+
+	if (i < argc && !strcmp(argv[i], "-n")) {
+		if (i + 1 >= argc) {
+			usage();
+		}
+		increment = atoi(argv[i + 1]);
+		i += 2;
+	}
+
+	errno = 0;
+	prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno != 0) {
+		err(1, "getpriority");
+	}
+
+	if (i >= argc) {
+		if (i > 1) {
+			usage();
+		}
+		printf("%d\n", prio);
+		return 0;
+	}
+
+	if (setpriority(PRIO_PROCESS, 0, prio + increment) < 0) {
+		err(1, "setpriority");
+	}
+
+	execvp(argv[i], &argv[i]);
+	err(1, "%s", argv[i]);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * faultbench.c
+ *
+ *	Measures page fault cost as the resident set grows.
+ *
+ *	The resident set is doubled step by step. At each step the new
+ *	pages are touched once (zero-fill faults) and then the whole
+ *	resident set is swept several times. Once the resident set is
+ *	larger than the TLB nearly every touch in a sweep is a TLB miss
+ *	on a page that is already resident, so the sweep time is
+ *	dominated by the page table lookup in vm_fault. With a page
+ *	table whose lookup cost does not depend on the number of pages,
+ *	both columns should stay roughly flat.
+ *
+ *	Usage: faultbench [maxpages]
+ *
+ *	maxpages should fit in physical memory, or the numbers will be
+ *	swamped by swapping.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define MAXPAGES	2048		/* 8M */
+#define DEFAULT_PAGES	512
+#define MINPAGES	16
+#define SWEEPS		4
+
+static char pages[MAXPAGES][PAGESIZE];
+
+static
+unsigned long
+elapsed_ns(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000000UL + (ns1 - ns0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxpages = DEFAULT_PAGES;
+	int rss, newrss, i, sweep;
+	time_t s0, s1;
+	unsigned long ns0, ns1, newcost, sweepcost;
+	volatile char *p;
+
+	if (argc > 2) {
+		errx(1, "Usage: faultbench [maxpages]");
+	}
+	if (argc == 2) {
+		maxpages = atoi(argv[1]);
+	}
+	if (maxpages < MINPAGES || maxpages > MAXPAGES) {
+		errx(1, "maxpages must be between %d and %d",
+		     MINPAGES, MAXPAGES);
+	}
+
+	printf("%8s %16s %16s\n", "rss", "ns/new page", "ns/resident page");
+
+	rss = 0;
+	for (newrss = MINPAGES; newrss <= maxpages; newrss *= 2) {
+
+		/* first touch of the new pages */
+		__time(&s0, &ns0);
+		for (i=rss; i<newrss; i++) {
+			p = &pages[i][0];
+			*p = (char) i;
+		}
+		__time(&s1, &ns1);
+		newcost = elapsed_ns(s0, ns0, s1, ns1) / (newrss - rss);
+		rss = newrss;
+
+		/* sweep the resident set; mostly TLB misses once rss > TLB */
+		__time(&s0, &ns0);
+		for (sweep=0; sweep<SWEEPS; sweep++) {
+			for (i=0; i<rss; i++) {
+				p = &pages[i][0];
+				if (*p != (char) i) {
+					errx(1, "page %d has wrong contents", i);
+				}
+			}
+		}
+		__time(&s1, &ns1);
+		sweepcost = elapsed_ns(s0, ns0, s1, ns1) / (SWEEPS * rss);
+
+		printf("%8d %16lu %16lu\n", rss, newcost, sweepcost);
+	}
+
+	return 0;
+}
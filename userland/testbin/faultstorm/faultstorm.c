@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * faultstorm.c
+ *
+ *	Measures how page fault throughput scales with the number of
+ *	processes faulting at once. Each child repeatedly grows its heap
+ *	with sbrk, touches every new page (one zero-fill fault and one
+ *	frame allocation each) and shrinks the heap again (one frame
+ *	free each). The run is repeated with 1, 2, 4, ... children up to
+ *	maxprocs, and the aggregate fault rate is printed for each.
+ *
+ *	Usage: faultstorm [maxprocs [npages [rounds]]]
+ *
+ *	Boot sys161 with several CPUs; with no serialization in the
+ *	fault path the rate should grow with the number of children
+ *	until it reaches the number of CPUs. npages * maxprocs should
+ *	fit in physical memory, or swapping will dominate.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define MAXPROCS	32
+
+#define DEFAULT_MAXPROCS	8
+#define DEFAULT_NPAGES		64
+#define DEFAULT_ROUNDS		16
+
+static
+void
+storm(int npages, int rounds)
+{
+	volatile char *base;
+	int i, round;
+
+	for (round=0; round<rounds; round++) {
+		base = sbrk(npages * PAGESIZE);
+		if (base == (void *)-1) {
+			_exit(1);
+		}
+		for (i=0; i<npages; i++) {
+			base[i * PAGESIZE] = (char) i;
+		}
+		if (sbrk(-npages * PAGESIZE) == (void *)-1) {
+			_exit(2);
+		}
+	}
+	_exit(0);
+}
+
+static
+int
+status_is_failure(int status)
+{
+	/* Proper interpretation of Unix exit status */
+	if (WIFSIGNALED(status)) {
+		return 1;
+	}
+	if (!WIFEXITED(status)) {
+		/* ? */
+		return 1;
+	}
+	status = WEXITSTATUS(status);
+	return status != 0;
+}
+
+/*
+ * Run NPROCS children at once; return the elapsed time in ms.
+ */
+static
+unsigned long
+run(int nprocs, int npages, int rounds)
+{
+	pid_t pids[MAXPROCS];
+	int i, status, failcount;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, ms;
+
+	__time(&startsecs, &startnsecs);
+
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			warn("fork");
+		}
+		if (pids[i] == 0) {
+			/* child */
+			storm(npages, rounds);
+		}
+	}
+
+	failcount = 0;
+	for (i=0; i<nprocs; i++) {
+		if (pids[i] < 0) {
+			failcount++;
+		}
+		else {
+			if (waitpid(pids[i], &status, 0) < 0) {
+				err(1, "waitpid");
+			}
+			if (status_is_failure(status)) {
+				failcount++;
+			}
+		}
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	if (failcount > 0) {
+		errx(1, "%d of %d subprocesses failed", failcount, nprocs);
+	}
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	ms = (endsecs - startsecs) * 1000 + (endnsecs - startnsecs) / 1000000;
+	return ms == 0 ? 1 : ms;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxprocs = DEFAULT_MAXPROCS;
+	int npages = DEFAULT_NPAGES;
+	int rounds = DEFAULT_ROUNDS;
+	int nprocs;
+	unsigned long ms, faults;
+
+	if (argc > 1) {
+		maxprocs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		rounds = atoi(argv[3]);
+	}
+	if (argc > 4 || maxprocs < 1 || maxprocs > MAXPROCS ||
+	    npages < 1 || rounds < 1) {
+		errx(1, "Usage: faultstorm [maxprocs [npages [rounds]]] "
+		     "(maxprocs <= %d)", MAXPROCS);
+	}
+
+	printf("%8s %12s %12s\n", "procs", "ms", "faults/s");
+
+	for (nprocs = 1; ; nprocs *= 2) {
+		if (nprocs > maxprocs) {
+			nprocs = maxprocs;
+		}
+		ms = run(nprocs, npages, rounds);
+		faults = (unsigned long) nprocs * npages * rounds;
+		printf("%8d %12lu %12lu\n", nprocs, ms, faults * 1000 / ms);
+		if (nprocs == maxprocs) {
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench.c
+ *
+ *	Measures the cost of fork as the parent's resident set grows.
+ *
+ *	For each parent size the parent touches that many pages, then
+ *	repeatedly forks a child that exits at once and waits for it.
+ *	With copy-on-write fork the per-fork time should be nearly
+ *	independent of the parent's size; with eager copying it grows
+ *	linearly. A final pass has the child write every page, to check
+ *	that parent and child see their own copies afterwards.
+ *
+ *	The time per fork is split into the fork call itself, in the
+ *	parent, and the exit: from fork returning until waitpid does,
+ *	which is mostly the child starting up, exiting and being
+ *	cleaned up.
+ *
+ *	Usage: forkbench [maxpages [forks]]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define MAXPAGES	1024		/* 4M */
+#define DEFAULT_PAGES	512
+#define DEFAULT_FORKS	16
+
+static char pages[MAXPAGES][PAGESIZE];
+
+static
+unsigned long
+elapsed_us(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000UL + (ns1 - ns0) / 1000;
+}
+
+static
+void
+touch(int npages, char val)
+{
+	int i;
+
+	for (i=0; i<npages; i++) {
+		pages[i][0] = val;
+		pages[i][PAGESIZE-1] = val;
+	}
+}
+
+static
+int
+check(int npages, char val)
+{
+	int i;
+
+	for (i=0; i<npages; i++) {
+		if (pages[i][0] != val || pages[i][PAGESIZE-1] != val) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fork a child and wait for it, adding the microseconds spent in fork
+ * and from there until the child was reaped to *forkus and *exitus.
+ */
+static
+void
+forkwait(int writechild, int npages,
+	 unsigned long *forkus, unsigned long *exitus)
+{
+	time_t s0, s1, s2;
+	unsigned long ns0, ns1, ns2;
+	pid_t pid;
+	int status;
+
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (writechild) {
+			if (check(npages, 'p')) {
+				_exit(1);
+			}
+			touch(npages, 'c');
+			if (check(npages, 'c')) {
+				_exit(2);
+			}
+		}
+		_exit(0);
+	}
+	__time(&s1, &ns1);
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	__time(&s2, &ns2);
+	*forkus += elapsed_us(s0, ns0, s1, ns1);
+	*exitus += elapsed_us(s1, ns1, s2, ns2);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed (status 0x%x)", status);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxpages = DEFAULT_PAGES, forks = DEFAULT_FORKS;
+	int npages, i;
+	unsigned long forkus, exitus;
+
+	if (argc > 3) {
+		errx(1, "Usage: forkbench [maxpages [forks]]");
+	}
+	if (argc > 1) {
+		maxpages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		forks = atoi(argv[2]);
+	}
+	if (maxpages < 1 || maxpages > MAXPAGES || forks < 1) {
+		errx(1, "maxpages must be between 1 and %d", MAXPAGES);
+	}
+
+	printf("%8s %12s %12s\n", "pages", "us/fork", "us/exit");
+
+	npages = 0;
+	for (;;) {
+		touch(npages, 'p');
+
+		forkus = exitus = 0;
+		for (i=0; i<forks; i++) {
+			forkwait(0, npages, &forkus, &exitus);
+		}
+		printf("%8d %12lu %12lu\n", npages, forkus / forks,
+		       exitus / forks);
+
+		if (npages == maxpages) {
+			break;
+		}
+		npages = npages == 0 ? 16 : npages * 4;
+		if (npages > maxpages) {
+			npages = maxpages;
+		}
+	}
+
+	/* child writes its copy; parent's must be unchanged */
+	forkus = exitus = 0;
+	forkwait(1, maxpages, &forkus, &exitus);
+	if (check(maxpages, 'p')) {
+		errx(1, "parent's pages changed by child writes");
+	}
+
+	printf("forkbench: passed\n");
+	return 0;
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c
+ *
+ *	Exercise mmap and munmap: anonymous memory, private and shared
+ *	across fork, including shared pages first touched after the fork;
+ *	a file mapped read-only and compared against read();
+ *	a shared writable file mapping whose changes must reach the file
+ *	after munmap, and only once when it is shared across fork; and
+ *	unmapping a hole in the middle of a mapping.
+ *
+ *	It also times summing the file through read() and through a
+ *	mapping, which is the point of having mmap: the mapped pages are
+ *	read straight into place instead of being copied through a
+ *	buffer.
+ *
+ *	Usage: mmaptest [npages]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define INTS		(PAGESIZE / sizeof(int))
+#define DEFAULT_NPAGES	64
+#define MAXPAGES	1024
+
+#define FILENAME	"mmaptest.dat"
+
+static int buf[INTS];
+
+static
+int
+pattern(int page, unsigned i)
+{
+	return (page << 12) ^ (int)i;
+}
+
+static
+unsigned long
+elapsed_ms(time_t s0, unsigned long ns0)
+{
+	time_t s1;
+	unsigned long ns1;
+
+	__time(&s1, &ns1);
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000 + (ns1 - ns0) / 1000000;
+}
+
+static
+int *
+map(size_t len, int prot, int flags, int fd)
+{
+	void *p;
+
+	p = mmap(NULL, len, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+static
+void
+test_anon(int npages, int flags)
+{
+	int *p;
+	unsigned i, n;
+	pid_t pid;
+	int shared = (flags & MAP_SHARED) != 0;
+
+	n = npages * INTS;
+	p = map(npages * PAGESIZE, PROT_READ | PROT_WRITE,
+		flags | MAP_ANONYMOUS, -1);
+	for (i=0; i<n; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous mapping not zeroed at %u", i);
+		}
+		p[i] = pattern(i / INTS, i);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<n; i++) {
+			if (p[i] != pattern(i / INTS, i)) {
+				errx(1, "child: parent's data lost at %u", i);
+			}
+			p[i] = ~p[i];
+		}
+		_exit(0);
+	}
+	waitchild(pid);
+
+	for (i=0; i<n; i++) {
+		int want = shared ? ~pattern(i / INTS, i) : pattern(i / INTS, i);
+		if (p[i] != want) {
+			errx(1, "%s anonymous mapping wrong at %u after fork",
+			     shared ? "shared" : "private", i);
+		}
+	}
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	printf("mmaptest: %s anonymous mapping ok\n",
+	       shared ? "shared" : "private");
+}
+
+/*
+ * A shared mapping nobody touches before fork: the child's writes
+ * must still show up in the parent.
+ */
+static
+void
+test_anon_untouched(int npages)
+{
+	int *p;
+	unsigned i, n;
+	pid_t pid;
+
+	n = npages * INTS;
+	p = map(npages * PAGESIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<n; i++) {
+			if (p[i] != 0) {
+				errx(1, "child: anonymous mapping not "
+				     "zeroed at %u", i);
+			}
+			p[i] = pattern(i / INTS, i);
+		}
+		_exit(0);
+	}
+	waitchild(pid);
+
+	for (i=0; i<n; i++) {
+		if (p[i] != pattern(i / INTS, i)) {
+			errx(1, "shared anonymous mapping untouched before "
+			     "fork wrong at %u", i);
+		}
+	}
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	printf("mmaptest: shared anonymous mapping untouched before fork ok\n");
+}
+
+static
+void
+makefile(int npages)
+{
+	int fd, page;
+	unsigned i;
+
+	fd = open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	for (page=0; page<npages; page++) {
+		for (i=0; i<INTS; i++) {
+			buf[i] = pattern(page, i);
+		}
+		if (write(fd, buf, PAGESIZE) != PAGESIZE) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+test_file_read(int npages)
+{
+	int fd, page, *p;
+	unsigned i, n;
+	unsigned long readsum, mapsum, readms, mapms;
+	time_t s;
+	unsigned long ns;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+
+	__time(&s, &ns);
+	readsum = 0;
+	for (page=0; page<npages; page++) {
+		if (read(fd, buf, PAGESIZE) != PAGESIZE) {
+			err(1, "%s: read", FILENAME);
+		}
+		for (i=0; i<INTS; i++) {
+			readsum += buf[i];
+		}
+	}
+	readms = elapsed_ms(s, ns);
+
+	__time(&s, &ns);
+	n = npages * INTS;
+	p = map(npages * PAGESIZE, PROT_READ, MAP_PRIVATE, fd);
+	mapsum = 0;
+	for (i=0; i<n; i++) {
+		mapsum += p[i];
+	}
+	mapms = elapsed_ms(s, ns);
+
+	for (i=0; i<n; i++) {
+		if (p[i] != pattern(i / INTS, i % INTS)) {
+			errx(1, "file mapping wrong at %u", i);
+		}
+	}
+	if (readsum != mapsum) {
+		errx(1, "read() and mmap disagree");
+	}
+	munmap(p, npages * PAGESIZE);
+	close(fd);
+
+	printf("mmaptest: file mapping ok; read() %lu.%03lu s, "
+	       "mmap %lu.%03lu s\n",
+	       readms / 1000, readms % 1000, mapms / 1000, mapms % 1000);
+}
+
+static
+void
+test_file_write(int npages)
+{
+	int fd, page, *p;
+	unsigned i;
+
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	p = map(npages * PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd);
+
+	/* Change the first word of every other page */
+	for (page=0; page<npages; page+=2) {
+		p[page * INTS] = -page;
+	}
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+
+	for (page=0; page<npages; page++) {
+		if (lseek(fd, (off_t)page * PAGESIZE, SEEK_SET) < 0) {
+			err(1, "lseek");
+		}
+		if (read(fd, buf, PAGESIZE) != PAGESIZE) {
+			err(1, "%s: read", FILENAME);
+		}
+		for (i=0; i<INTS; i++) {
+			int want = (i == 0 && page % 2 == 0) ?
+				-page : pattern(page, i);
+			if (buf[i] != want) {
+				errx(1, "page %d word %u not written back",
+				     page, i);
+			}
+		}
+	}
+	close(fd);
+	printf("mmaptest: shared file mapping written back ok\n");
+}
+
+/*
+ * A shared file page written before fork is written back by the child
+ * when it exits. A later write(2) to the file must then survive the
+ * parent's munmap: the parent's copy is no longer newer than the file.
+ */
+static
+void
+test_file_fork(void)
+{
+	int fd, *p, word;
+	pid_t pid;
+
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	p = map(PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd);
+	p[0] = 1;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(0);
+	}
+	waitchild(pid);
+
+	word = 2;
+	if (lseek(fd, sizeof(int), SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (write(fd, &word, sizeof(word)) != sizeof(word)) {
+		err(1, "%s: write", FILENAME);
+	}
+	if (munmap(p, PAGESIZE)) {
+		err(1, "munmap");
+	}
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, buf, PAGESIZE) != PAGESIZE) {
+		err(1, "%s: read", FILENAME);
+	}
+	if (buf[0] != 1) {
+		errx(1, "shared file page not written back at exit");
+	}
+	if (buf[1] != 2) {
+		errx(1, "munmap wrote back a page the child already had");
+	}
+	close(fd);
+	printf("mmaptest: shared file mapping written back once ok\n");
+}
+
+static
+void
+test_hole(void)
+{
+	int *p;
+	pid_t pid;
+
+	p = map(3 * PAGESIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1);
+	p[0] = 1;
+	p[INTS] = 2;
+	p[2 * INTS] = 3;
+	if (munmap(p + INTS, PAGESIZE)) {
+		err(1, "munmap");
+	}
+	if (p[0] != 1 || p[2 * INTS] != 3) {
+		errx(1, "munmap of a hole lost the pages around it");
+	}
+
+	/* Touching the hole should now kill us; try it in a child */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[INTS] = 4;
+		_exit(0);
+	}
+	{
+		int status;
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			errx(1, "unmapped page still accessible");
+		}
+	}
+	printf("mmaptest: munmap of a hole ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = DEFAULT_NPAGES;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2 || npages < 2 || npages > MAXPAGES) {
+		errx(1, "Usage: mmaptest [npages] (2 <= npages <= %d)",
+		     MAXPAGES);
+	}
+
+	test_anon(npages, MAP_PRIVATE);
+	test_anon(npages, MAP_SHARED);
+	test_anon_untouched(npages);
+	makefile(npages);
+	test_file_read(npages);
+	test_file_write(npages);
+	test_file_fork();
+	test_hole();
+	remove(FILENAME);
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * readthrash.c
+ *
+ *	A read-mostly workload larger than physical memory. The pages
+ *	are filled in once and then swept over and over, checking their
+ *	contents; only one page in every "writeevery" is modified on
+ *	each pass. Most pages therefore come back from swap and are
+ *	evicted again unchanged, and with dirty page tracking most of
+ *	those evictions need no swap write.
+ *
+ *	Usage: readthrash [npages [passes [writeevery]]]
+ *
+ *	Run the kernel's "vmstat reset" before and "vmstat" after; the
+ *	"clean evictions" line is the number of swap writes saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define MAXPAGES	2048		/* 8M */
+#define INTS		(PAGESIZE / sizeof(int))
+
+#define DEFAULT_NPAGES		1024
+#define DEFAULT_PASSES		4
+#define DEFAULT_WRITEEVERY	16
+
+static int pages[MAXPAGES][PAGESIZE / sizeof(int)];
+
+static
+int
+pattern(int page, int version)
+{
+	return (page << 8) ^ version;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = DEFAULT_NPAGES;
+	int passes = DEFAULT_PASSES;
+	int writeevery = DEFAULT_WRITEEVERY;
+	static int version[MAXPAGES];
+	int page, pass, writes;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, ms;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		passes = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		writeevery = atoi(argv[3]);
+	}
+	if (argc > 4 || npages < 1 || npages > MAXPAGES ||
+	    passes < 1 || writeevery < 1) {
+		errx(1, "Usage: readthrash [npages [passes [writeevery]]] "
+		     "(npages <= %d)", MAXPAGES);
+	}
+
+	printf("readthrash: %d pages (%dk), %d passes, "
+	       "writing 1 page in %d\n",
+	       npages, npages * (PAGESIZE / 1024), passes, writeevery);
+
+	for (page=0; page<npages; page++) {
+		pages[page][0] = pattern(page, 0);
+		pages[page][INTS - 1] = pattern(page, 0);
+	}
+
+	__time(&startsecs, &startnsecs);
+
+	writes = 0;
+	for (pass=0; pass<passes; pass++) {
+		for (page=0; page<npages; page++) {
+			if (pages[page][0] != pattern(page, version[page]) ||
+			    pages[page][INTS - 1] !=
+			    pattern(page, version[page])) {
+				errx(1, "page %d corrupt on pass %d",
+				     page, pass);
+			}
+			if ((page + pass) % writeevery == 0) {
+				version[page]++;
+				pages[page][0] = pattern(page, version[page]);
+				pages[page][INTS - 1] =
+					pattern(page, version[page]);
+				writes++;
+			}
+		}
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	ms = (endsecs - startsecs) * 1000 + (endnsecs - startnsecs) / 1000000;
+
+	printf("Elapsed %lu.%03lu seconds, %d page reads, %d page writes\n",
+	       ms / 1000, ms % 1000, npages * passes, writes);
+	printf("readthrash: passed\n");
+	return 0;
+}
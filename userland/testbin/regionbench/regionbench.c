@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * regionbench.c
+ *
+ *	Measures page fault cost as the number of mapped regions grows.
+ *
+ *	At each step the number of separate anonymous mappings is
+ *	doubled, and a fixed set of pages, more than the TLB holds, is
+ *	spread across them and swept repeatedly. Nearly every touch is
+ *	then a TLB miss on a resident page, so the sweep time is
+ *	dominated by vm_fault finding the region and the page.
+ *
+ *	Two orders are timed: "spread" visits a different region on
+ *	every touch, and "clustered" visits all the pages of one region
+ *	before moving on to the next. With a lookup that does not walk
+ *	every region, both columns should stay roughly flat; clustered
+ *	faults can be cheaper still if the last region found is
+ *	remembered.
+ *
+ *	Usage: regionbench [maxregions]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define TOUCHPAGES	256		/* 4x the TLB */
+#define REGIONPAGES	TOUCHPAGES	/* so one region can hold them all */
+#define DEFAULT_REGIONS	256
+#define MAXREGIONS	512
+#define SWEEPS		4
+
+static char *regions[MAXREGIONS];
+
+static
+unsigned long
+elapsed_ns(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000000UL + (ns1 - ns0);
+}
+
+/*
+ * Address of touched page I with N regions: page I lives in region
+ * I % N, at page I / N within it.
+ */
+static
+volatile char *
+touchpage(int n, int i)
+{
+	return regions[i % n] + (i / n) * PAGESIZE;
+}
+
+/*
+ * Sweep the touched pages in the given order and return the cost
+ * per touch. In spread order consecutive touches go to consecutive
+ * regions; in clustered order they stay in one region as long as it
+ * has touched pages.
+ */
+static
+unsigned long
+sweep(int n, int clustered)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	int pass, i, r, k;
+	volatile char *p;
+
+	__time(&s0, &ns0);
+	for (pass=0; pass<SWEEPS; pass++) {
+		if (clustered) {
+			for (r=0; r<n; r++) {
+				for (k=r; k<TOUCHPAGES; k+=n) {
+					p = touchpage(n, k);
+					if (*p != (char) k) {
+						errx(1, "page %d has wrong "
+						     "contents", k);
+					}
+				}
+			}
+		}
+		else {
+			for (i=0; i<TOUCHPAGES; i++) {
+				p = touchpage(n, i);
+				if (*p != (char) i) {
+					errx(1, "page %d has wrong contents",
+					     i);
+				}
+			}
+		}
+	}
+	__time(&s1, &ns1);
+	return elapsed_ns(s0, ns0, s1, ns1) / (SWEEPS * TOUCHPAGES);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxregions = DEFAULT_REGIONS;
+	int n, i;
+	unsigned long spread, clustered;
+
+	if (argc > 2) {
+		errx(1, "Usage: regionbench [maxregions]");
+	}
+	if (argc == 2) {
+		maxregions = atoi(argv[1]);
+	}
+	if (maxregions < 1 || maxregions > MAXREGIONS) {
+		errx(1, "maxregions must be between 1 and %d", MAXREGIONS);
+	}
+
+	printf("%8s %16s %16s\n", "regions", "ns/spread", "ns/clustered");
+
+	for (n = 1; n <= maxregions; n *= 2) {
+		for (i=0; i<n; i++) {
+			regions[i] = mmap(NULL, REGIONPAGES * PAGESIZE,
+					  PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (regions[i] == MAP_FAILED) {
+				err(1, "mmap of region %d of %d", i, n);
+			}
+		}
+
+		/* first touch, untimed */
+		for (i=0; i<TOUCHPAGES; i++) {
+			*touchpage(n, i) = (char) i;
+		}
+
+		spread = sweep(n, 0);
+		clustered = sweep(n, 1);
+		printf("%8d %16lu %16lu\n", n, spread, clustered);
+
+		for (i=0; i<n; i++) {
+			if (munmap(regions[i], REGIONPAGES * PAGESIZE) < 0) {
+				err(1, "munmap of region %d of %d", i, n);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sbrkbench.c
+ *
+ *	Measures the cost of growing and shrinking the heap with sbrk.
+ *
+ *	At each step the heap is grown by twice as many pages as the
+ *	step before, the new pages are touched, and the heap is shrunk
+ *	back, several times over. Three costs per page are reported:
+ *	growing and writing every page ("grow+touch"), giving back pages
+ *	that were all written ("shrink dirty"), and giving back pages
+ *	that were only read, which are mapped to the shared zero page
+ *	and have no frame of their own ("shrink clean"). Shrinking
+ *	should cost the same per page however large the step is.
+ *
+ *	Usage: sbrkbench [maxpages]
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define DEFAULT_PAGES	512
+#define MAXPAGES	4096
+#define ROUNDS		8
+
+static
+unsigned long
+elapsed_ns(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000000UL + (ns1 - ns0);
+}
+
+/*
+ * Grow the heap by NPAGES, touch each page (writing it if WRITE),
+ * and shrink it back, ROUNDS times. Adds the time spent growing and
+ * touching to *GROW and the time spent shrinking to *SHRINK.
+ */
+static
+void
+cycle(int npages, int write, unsigned long *grow, unsigned long *shrink)
+{
+	time_t s0, s1, s2;
+	unsigned long ns0, ns1, ns2;
+	volatile char *base;
+	char sum;
+	int round, i;
+
+	for (round=0; round<ROUNDS; round++) {
+		__time(&s0, &ns0);
+		base = sbrk(npages * PAGESIZE);
+		if (base == (void *)-1) {
+			err(1, "sbrk of %d pages", npages);
+		}
+		sum = 0;
+		for (i=0; i<npages; i++) {
+			if (write) {
+				base[i * PAGESIZE] = (char) i;
+			}
+			else {
+				sum += base[i * PAGESIZE];
+			}
+		}
+		if (sum != 0) {
+			errx(1, "fresh heap page is not zero");
+		}
+		__time(&s1, &ns1);
+		if (sbrk(-npages * PAGESIZE) == (void *)-1) {
+			err(1, "sbrk of -%d pages", npages);
+		}
+		__time(&s2, &ns2);
+
+		*grow += elapsed_ns(s0, ns0, s1, ns1);
+		*shrink += elapsed_ns(s1, ns1, s2, ns2);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxpages = DEFAULT_PAGES;
+	int n;
+	unsigned long grow, dirty, clean, unused;
+
+	if (argc > 2) {
+		errx(1, "Usage: sbrkbench [maxpages]");
+	}
+	if (argc == 2) {
+		maxpages = atoi(argv[1]);
+	}
+	if (maxpages < 1 || maxpages > MAXPAGES) {
+		errx(1, "maxpages must be between 1 and %d", MAXPAGES);
+	}
+
+	printf("%8s %16s %16s %16s\n", "pages", "ns/grow+touch",
+	       "ns/shrink dirty", "ns/shrink clean");
+
+	for (n = 1; n <= maxpages; n *= 2) {
+		grow = dirty = 0;
+		cycle(n, 1, &grow, &dirty);
+		unused = clean = 0;
+		cycle(n, 0, &unused, &clean);
+		printf("%8d %16lu %16lu %16lu\n", n, grow / (ROUNDS * n),
+		       dirty / (ROUNDS * n), clean / (ROUNDS * n));
+	}
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * schedbench.c
+ *
+ *	Measures how quickly short jobs get through while the CPU is
+ *	busy with long ones.
+ *
+ *	A number of "hog" processes spin, counting, while the parent
+ *	plays a shell: it repeatedly forks a child that exits at once
+ *	and waits for it, and times each round trip. This is done with
+ *	0, 1, 2, 4, ... up to maxhogs hogs running. For each count the
+ *	average and worst round trip are printed, along with how many
+ *	loops the hogs got through per second in total.
+ *
+ *	With plain round-robin every wakeup of the parent or its child
+ *	waits behind every hog, so the round trip grows with the number
+ *	of hogs. A scheduler that favors threads that sleep a lot should
+ *	keep it close to the unloaded time, at little cost to the hogs.
+ *
+ *	Usage: schedbench [maxhogs [commands]]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXHOGS		8
+#define DEFAULT_HOGS	4
+#define DEFAULT_COMMANDS 50
+
+/* Shared with the hogs */
+struct board {
+	volatile int stop;
+	volatile unsigned long loops[MAXHOGS];
+};
+
+static struct board *board;
+
+static
+unsigned long
+elapsed_us(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000UL + (ns1 - ns0) / 1000;
+}
+
+static
+void
+hog(int n)
+{
+	while (!board->stop) {
+		board->loops[n]++;
+	}
+	_exit(0);
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed (status 0x%x)", status);
+	}
+}
+
+/*
+ * Run one short command: fork a child that exits at once, wait for
+ * it, and return how long that took.
+ */
+static
+unsigned long
+command(void)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	pid_t pid;
+
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(0);
+	}
+	waitchild(pid);
+	__time(&s1, &ns1);
+	return elapsed_us(s0, ns0, s1, ns1);
+}
+
+static
+void
+run(int nhogs, int commands)
+{
+	pid_t pids[MAXHOGS];
+	time_t s0, s1;
+	unsigned long ns0, ns1, us, total, worst, loops;
+	int i;
+
+	board->stop = 0;
+	for (i=0; i<nhogs; i++) {
+		board->loops[i] = 0;
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			hog(i);
+		}
+	}
+
+	total = worst = 0;
+	__time(&s0, &ns0);
+	for (i=0; i<commands; i++) {
+		us = command();
+		total += us;
+		if (us > worst) {
+			worst = us;
+		}
+	}
+	__time(&s1, &ns1);
+
+	board->stop = 1;
+	loops = 0;
+	for (i=0; i<nhogs; i++) {
+		loops += board->loops[i];
+	}
+	for (i=0; i<nhogs; i++) {
+		waitchild(pids[i]);
+	}
+
+	us = elapsed_us(s0, ns0, s1, ns1);
+	printf("%6d %14lu %14lu %14lu\n", nhogs, total / commands, worst,
+	       us == 0 ? 0 : (unsigned long)
+	       ((unsigned long long)loops * 1000 / us));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxhogs = DEFAULT_HOGS, commands = DEFAULT_COMMANDS;
+	int n;
+
+	if (argc > 3) {
+		errx(1, "Usage: schedbench [maxhogs [commands]]");
+	}
+	if (argc > 1) {
+		maxhogs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		commands = atoi(argv[2]);
+	}
+	if (maxhogs < 0 || maxhogs > MAXHOGS || commands < 1) {
+		errx(1, "maxhogs must be between 0 and %d", MAXHOGS);
+	}
+
+	board = mmap(NULL, sizeof(*board), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (board == MAP_FAILED) {
+		err(1, "mmap");
+	}
+
+	printf("%6s %14s %14s %14s\n", "hogs", "us/command", "worst us",
+	       "hog Kloops/s");
+	run(0, commands);
+	for (n = 1; n <= maxhogs; n *= 2) {
+		run(n, commands);
+	}
+
+	return 0;
+}
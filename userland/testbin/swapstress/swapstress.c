@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * swapstress.c
+ *
+ *	Forks several processes whose combined working set is larger
+ *	than physical memory and has each of them sweep its pages over
+ *	and over, checking the contents every time. This only passes if
+ *	pages are really written to swap and read back intact.
+ *
+ *	Usage: swapstress [nprocs [npages [passes]]]
+ *
+ *	Reports the elapsed time and the page touch rate; run the
+ *	kernel's "vmstat" menu command before and after to see the
+ *	corresponding fault and swap I/O rates.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define MAXPAGES	1024		/* 4M per process */
+#define MAXPROCS	16
+
+#define DEFAULT_NPROCS	4
+#define DEFAULT_NPAGES	512
+#define DEFAULT_PASSES	4
+
+static int pages[MAXPAGES][PAGESIZE / sizeof(int)];
+
+/*
+ * Use this instead of just calling printf so we know each printout
+ * is atomic; this prevents the lines from getting intermingled.
+ */
+static
+void
+say(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	write(STDOUT_FILENO, buf, strlen(buf));
+}
+
+static
+int
+pattern(int proc, int page, int pass)
+{
+	return (proc << 24) ^ (page << 8) ^ pass;
+}
+
+/*
+ * Visit the pages in a scattered order so that neighbouring pages are
+ * not always touched back to back. Stepping by an odd stride visits
+ * every page exactly once when npages is a power of two; otherwise we
+ * fall back to a plain sweep.
+ */
+static
+int
+visit(int i, int npages)
+{
+	if ((npages & (npages - 1)) == 0) {
+		return (i * 37) & (npages - 1);
+	}
+	return i;
+}
+
+static
+void
+go(int mynum, int npages, int passes)
+{
+	int i, page, pass, last;
+
+	for (page=0; page<npages; page++) {
+		pages[page][0] = pattern(mynum, page, 0);
+		pages[page][PAGESIZE / sizeof(int) - 1] = pattern(mynum, page, 0);
+	}
+
+	for (pass=1; pass<=passes; pass++) {
+		for (i=0; i<npages; i++) {
+			page = visit(i, npages);
+			last = PAGESIZE / sizeof(int) - 1;
+			if (pages[page][0] != pattern(mynum, page, pass-1) ||
+			    pages[page][last] != pattern(mynum, page, pass-1)) {
+				say("Process %d: page %d corrupt on pass %d\n",
+				    mynum, page, pass);
+				exit(1);
+			}
+			pages[page][0] = pattern(mynum, page, pass);
+			pages[page][last] = pattern(mynum, page, pass);
+		}
+	}
+
+	say("Process %d (pid %d): %d pages, %d passes: passed\n",
+	    mynum, (int) getpid(), npages, passes);
+	exit(0);
+}
+
+static
+int
+status_is_failure(int status)
+{
+	/* Proper interpretation of Unix exit status */
+	if (WIFSIGNALED(status)) {
+		return 1;
+	}
+	if (!WIFEXITED(status)) {
+		/* ? */
+		return 1;
+	}
+	status = WEXITSTATUS(status);
+	return status != 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nprocs = DEFAULT_NPROCS;
+	int npages = DEFAULT_NPAGES;
+	int passes = DEFAULT_PASSES;
+	pid_t pids[MAXPROCS];
+	int i, status, failcount;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, ms, touches;
+
+	if (argc > 1) {
+		nprocs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		passes = atoi(argv[3]);
+	}
+	if (argc > 4 || nprocs < 1 || nprocs > MAXPROCS ||
+	    npages < 1 || npages > MAXPAGES || passes < 1) {
+		errx(1, "Usage: swapstress [nprocs [npages [passes]]] "
+		     "(nprocs <= %d, npages <= %d)", MAXPROCS, MAXPAGES);
+	}
+
+	printf("Forking %d processes of %d pages each; total load %dk\n",
+	       nprocs, npages, nprocs * npages * (PAGESIZE / 1024));
+
+	__time(&startsecs, &startnsecs);
+
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			warn("fork");
+		}
+		if (pids[i] == 0) {
+			/* child */
+			go(i, npages, passes);
+		}
+	}
+
+	failcount = 0;
+	for (i=0; i<nprocs; i++) {
+		if (pids[i] < 0) {
+			failcount++;
+		}
+		else {
+			if (waitpid(pids[i], &status, 0) < 0) {
+				err(1, "waitpid");
+			}
+			if (status_is_failure(status)) {
+				failcount++;
+			}
+		}
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	ms = (endsecs - startsecs) * 1000 + (endnsecs - startnsecs) / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+	touches = (unsigned long) nprocs * npages * (passes + 1);
+
+	printf("Elapsed %lu.%03lu seconds, %lu page touches (%lu/s)\n",
+	       ms / 1000, ms % 1000, touches, touches * 1000 / ms);
+
+	if (failcount > 0) {
+		printf("%d subprocesses failed\n", failcount);
+		exit(1);
+	}
+	printf("Test complete\n");
+	return 0;
+}
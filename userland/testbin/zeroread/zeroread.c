@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * zeroread.c
+ *
+ *	Reads a large stretch of fresh heap before writing any of it,
+ *	the way a sparse array is used.
+ *
+ *	The heap is grown by npages pages, which are then read once,
+ *	swept again, and finally written. With a shared zero page the
+ *	read passes cost a TLB fill each and use no memory at all; only
+ *	the write pass allocates and zeroes frames. The "memory in use"
+ *	and "zero page maps" lines of the kernel's vmstat command, taken
+ *	before and after a run, show what was saved.
+ *
+ *	Usage: zeroread [npages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define DEFAULT_PAGES	1024		/* 4M */
+#define MAXPAGES	16384		/* 64M */
+
+static
+unsigned long
+elapsed_ns(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	return (s1 - s0) * 1000000000UL + (ns1 - ns0);
+}
+
+/*
+ * Read every page of the buffer; check they are all still zero.
+ */
+static
+unsigned long
+readpass(volatile char *buf, int npages)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	int i;
+
+	__time(&s0, &ns0);
+	for (i=0; i<npages; i++) {
+		if (buf[i * PAGESIZE] != 0 ||
+		    buf[i * PAGESIZE + PAGESIZE - 1] != 0) {
+			errx(1, "page %d of fresh heap is not zero", i);
+		}
+	}
+	__time(&s1, &ns1);
+	return elapsed_ns(s0, ns0, s1, ns1) / npages;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = DEFAULT_PAGES;
+	int i;
+	time_t s0, s1;
+	unsigned long ns0, ns1, firstcost, sweepcost, writecost;
+	volatile char *buf;
+
+	if (argc > 2) {
+		errx(1, "Usage: zeroread [npages]");
+	}
+	if (argc == 2) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 1 || npages > MAXPAGES) {
+		errx(1, "npages must be between 1 and %d", MAXPAGES);
+	}
+
+	buf = sbrk(npages * PAGESIZE);
+	if (buf == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	firstcost = readpass(buf, npages);
+	sweepcost = readpass(buf, npages);
+
+	__time(&s0, &ns0);
+	for (i=0; i<npages; i++) {
+		buf[i * PAGESIZE] = (char) i;
+	}
+	__time(&s1, &ns1);
+	writecost = elapsed_ns(s0, ns0, s1, ns1) / npages;
+
+	for (i=0; i<npages; i++) {
+		if (buf[i * PAGESIZE] != (char) i ||
+		    buf[i * PAGESIZE + 1] != 0) {
+			errx(1, "page %d has wrong contents after write", i);
+		}
+	}
+
+	printf("%d pages\n", npages);
+	printf("%16s %16s %16s\n", "ns/first read", "ns/read sweep",
+	       "ns/first write");
+	printf("%16lu %16lu %16lu\n", firstcost, sweepcost, writecost);
+
+	return 0;
+}